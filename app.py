@@ -1,18 +1,48 @@
-from fastapi import FastAPI, Query, HTTPException
-from kdtree_wrapper import lib, Tarv, TReg, TRegArray, EMBEDDING_DIM, MAX_PERSON_ID_LEN
+import os
+from contextlib import asynccontextmanager
+from fastapi import FastAPI, Query, HTTPException, Request
+from fastapi.concurrency import run_in_threadpool
+from fastapi.responses import StreamingResponse, PlainTextResponse
+import json
+from kdtree_wrapper import lib, Tarv, TReg, TRegArray, EMBEDDING_DIM, MAX_PERSON_ID_LEN, FAIXAS_LATENCIA, inserir_lote, buscar_lote, metricas
 from ctypes import POINTER, c_char, c_float
-from pydantic import BaseModel, Field
-from typing import List
+import numpy as np
+from pydantic import BaseModel, ConfigDict, Field, field_validator
+from typing import List, Tuple
+from pydantic import ValidationError
 
-app = FastAPI()
+# Optional persistence: last snapshot plus the log of writes made after it
+KDTREE_SNAPSHOT = os.environ.get("KDTREE_SNAPSHOT")
+KDTREE_LOG = os.environ.get("KDTREE_LOG")
+
+@asynccontextmanager
+async def lifespan(app: FastAPI):
+    if lib is not None and (KDTREE_SNAPSHOT or KDTREE_LOG):
+        snapshot = KDTREE_SNAPSHOT.encode() if KDTREE_SNAPSHOT else None
+        log = KDTREE_LOG.encode() if KDTREE_LOG else None
+        if lib.carregar_arvore(snapshot, log) != 0:
+            raise RuntimeError("Failed to restore the KD-Tree from snapshot/log.")
+    yield
+
+app = FastAPI(lifespan=lifespan)
 
 # Pydantic model for input data (insertion)
 class PontoEntrada(BaseModel):
+    # NaN/inf coordinates break the tree's comparator and the search heap
+    model_config = ConfigDict(allow_inf_nan=False)
     lat: float
     lon: float
     embedding: List[float] = Field(..., min_length=EMBEDDING_DIM, max_length=EMBEDDING_DIM)
     person_id: str = Field(..., max_length=MAX_PERSON_ID_LEN - 1)
 
+    # The C side truncates at MAX_PERSON_ID_LEN - 1 bytes, which could split a UTF-8 character
+    @field_validator("person_id")
+    @classmethod
+    def _person_id_cabe(cls, person_id: str) -> str:
+        if len(person_id.encode("utf-8")) > MAX_PERSON_ID_LEN - 1:
+            raise ValueError(f"person_id must fit in {MAX_PERSON_ID_LEN - 1} UTF-8 bytes")
+        return person_id
+
 # Pydantic model for search results
 class PontoResultado(BaseModel):
     lat: float
@@ -20,62 +50,263 @@ class PontoResultado(BaseModel):
     person_id: str
     embedding: List[float]
 
+# Neighbours per query: the C side allocates n slots per query up front
+MAX_VIZINHOS = 1000
+
+# Pydantic model for batch search input
+class ConsultaLote(BaseModel):
+    model_config = ConfigDict(allow_inf_nan=False)
+    pontos: List[Tuple[float, float]] = Field(..., min_length=1)  # (lat, lon)
+    n: int = Field(1, ge=1, le=MAX_VIZINHOS)
+
+# Batch endpoints: points per C call (neighbours per C call for /buscar-lote), and the packed
+# record accepted by /inserir-lote as application/octet-stream (little-endian, no padding:
+# 8 + 8 + 4*128 + 100 bytes)
+TAMANHO_LOTE = 10000
+REGISTRO_BINARIO = np.dtype([("lat", "<f8"),
+                             ("lon", "<f8"),
+                             ("embedding", "<f4", (EMBEDDING_DIM,)),
+                             ("person_id", f"S{MAX_PERSON_ID_LEN}")])
+CAMPOS_RESULTADO = ("lat", "lon", "person_id", "embedding", "distancia")
+
 # Helper to check if C library is loaded
 def _check_lib_loaded():
     if lib is None:
         raise HTTPException(status_code=500, detail="C library (libkdtree.so) not loaded. Check server logs.")
 
+# Helper to build a null-terminated C person_id buffer
+def _person_id_to_c(person_id: str):
+    c_person_id_array = (c_char * MAX_PERSON_ID_LEN)()
+    # Truncated so the terminating null always fits
+    c_person_id_array.value = person_id.encode('utf-8')[:MAX_PERSON_ID_LEN - 1]
+    return c_person_id_array
+
 @app.post("/construir-arvore")
 def constroi_arvore():
     _check_lib_loaded()
     lib.kdtree_construir()
     return {"message": "KD-Tree initialized."}
 
+@app.post("/salvar")
+def salvar():
+    _check_lib_loaded()
+    if not KDTREE_SNAPSHOT:
+        raise HTTPException(status_code=400, detail="KDTREE_SNAPSHOT is not set.")
+    if lib.salvar_arvore(KDTREE_SNAPSHOT.encode()) != 0:
+        raise HTTPException(status_code=500, detail="Failed to save the KD-Tree snapshot.")
+    return {"message": f"Snapshot saved to '{KDTREE_SNAPSHOT}'."}
+
 @app.post("/inserir")
 def inserir(ponto: PontoEntrada):
     _check_lib_loaded()
 
-    c_embedding = (c_float * EMBEDDING_DIM)(*ponto.embedding)
-    
-    person_id_bytes = ponto.person_id.encode('utf-8')
-    c_person_id_array = (c_char * MAX_PERSON_ID_LEN)()
-    # Copy bytes safely, ensuring null-termination
-    for i, byte in enumerate(person_id_bytes):
-        if i < MAX_PERSON_ID_LEN - 1:
-            c_person_id_array[i] = byte
-        else:
-            break
-    c_person_id_array[min(len(person_id_bytes), MAX_PERSON_ID_LEN - 1)] = b'\0'
-
-    lib.inserir_ponto(ponto.lat, ponto.lon, c_embedding, c_person_id_array)
+    inserir_lote([[ponto.lat, ponto.lon]], [ponto.embedding], [ponto.person_id])
     return {"message": f"Point '{ponto.person_id}' inserted."}
 
+@app.put("/atualizar")
+def atualizar(ponto: PontoEntrada):
+    _check_lib_loaded()
+
+    c_embedding = np.ascontiguousarray(ponto.embedding, dtype=np.float32).ctypes.data_as(POINTER(c_float * EMBEDDING_DIM)).contents
+    c_person_id_array = _person_id_to_c(ponto.person_id)
+
+    if lib.atualizar_ponto(ponto.lat, ponto.lon, c_embedding, c_person_id_array) != 0:
+        raise HTTPException(status_code=404, detail=f"Point '{ponto.person_id}' not found.")
+    return {"message": f"Point '{ponto.person_id}' updated."}
+
+@app.delete("/remover")
+def remover(person_id: str = Query(..., max_length=MAX_PERSON_ID_LEN - 1)):
+    _check_lib_loaded()
+
+    if lib.remover_ponto(_person_id_to_c(person_id)) != 0:
+        raise HTTPException(status_code=404, detail=f"Point '{person_id}' not found.")
+    return {"message": f"Point '{person_id}' removed."}
+
 @app.get("/buscar-n-vizinhos", response_model=List[PontoResultado])
-def buscar_n_vizinhos(lat: float = Query(...), lon: float = Query(...), n: int = Query(1, ge=1)):
+def buscar_n_vizinhos(lat: float = Query(..., allow_inf_nan=False), lon: float = Query(..., allow_inf_nan=False),
+                      n: int = Query(1, ge=1, le=MAX_VIZINHOS)):
     _check_lib_loaded()
-    
-    # Query point
-    query_reg = TReg(lat=lat, lon=lon,
-                     embedding=(c_float * EMBEDDING_DIM)(*[0.0]*EMBEDDING_DIM),
-                     person_id="query".encode('utf-8'))
 
     arv = lib.get_tree()
     if not arv:
         raise HTTPException(status_code=500, detail="KD-Tree not initialized. Use /construir-arvore first.")
 
-    c_results_array = lib.buscar_n_mais_proximos(arv, query_reg, n)
+    # Results point into the pinned tree: copy the records once, then release
+    try:
+        res = buscar_lote([[lat, lon]], n, arv)
+    except MemoryError:
+        raise HTTPException(status_code=413, detail=f"Not enough memory for {n} neighbours.")
+    with res:
+        regs = res.regs[0, :res.tamanhos[0]]
+        lats = regs["lat"].tolist()
+        lons = regs["lon"].tolist()
+        person_ids = regs["person_id"].tolist()
+        embeddings = regs["embedding"].tolist()
+
+    return [PontoResultado(lat=lats[i], lon=lons[i], person_id=person_ids[i].decode('utf-8', 'replace'), embedding=embeddings[i])
+            for i in range(len(lats))]
+
+# The C calls below run in the threadpool; ctypes releases the GIL while they run
+
+def _inserir_pontos(pontos: List[PontoEntrada]):
+    inserir_lote([[p.lat, p.lon] for p in pontos], [p.embedding for p in pontos], [p.person_id for p in pontos])
+
+def _validar_registros(registros, primeiro: int):
+    """Raises ValueError naming the first record (position in the body) that /inserir-lote cannot store."""
+    finitos = np.isfinite(registros["lat"]) & np.isfinite(registros["lon"]) & np.isfinite(registros["embedding"]).all(axis=1)
+    if not finitos.all():
+        raise ValueError(f"Record {primeiro + int(np.argmin(finitos))}: lat, lon and embedding must be finite")
+    # Ids are stored up to the first null and at most MAX_PERSON_ID_LEN - 1 bytes; only non-ASCII ones need decoding
+    ids = np.ascontiguousarray(registros["person_id"]).view(np.uint8).reshape(len(registros), MAX_PERSON_ID_LEN)
+    for i in np.flatnonzero((ids[:, :MAX_PERSON_ID_LEN - 1] >= 0x80).any(axis=1)).tolist():
+        try:
+            ids[i, :MAX_PERSON_ID_LEN - 1].tobytes().split(b"\0", 1)[0].decode("utf-8")
+        except UnicodeDecodeError:
+            raise ValueError(f"Record {primeiro + i}: person_id is not valid UTF-8") from None
 
-    results = []
+def _inserir_registros(registros, primeiro: int):
+    _validar_registros(registros, primeiro)
+    inserir_lote(np.stack([registros["lat"], registros["lon"]], axis=1), registros["embedding"], registros["person_id"])
+
+def _inserir_linhas(linhas):
+    """Parses (line number, bytes) NDJSON lines and inserts them; raises ValueError at the first invalid line."""
+    pontos = []
+    for numero, linha in linhas:
+        try:
+            pontos.append(PontoEntrada.model_validate_json(linha))
+        except ValidationError as e:
+            raise ValueError(f"Line {numero}: {e.errors(include_context=False)}") from None
+    _inserir_pontos(pontos)
+
+@app.post("/inserir-lote")
+async def inserir_em_lote(request: Request):
+    """Body: NDJSON, one PontoEntrada per line, or application/octet-stream with REGISTRO_BINARIO records."""
+    _check_lib_loaded()
+    binario = request.headers.get("content-type", "").startswith("application/octet-stream")
+    tamanho = REGISTRO_BINARIO.itemsize
+    pendente = bytearray()  # Consumed from the front, so earlier chunks are not copied again
+    linhas = []
+    linha_atual = 0
+    total = 0
+
+    # Parsing, validation and the C call all run in the threadpool
+    async def insere(n, funcao, *args):
+        nonlocal total
+        try:
+            await run_in_threadpool(funcao, *args)
+        except ValueError as e:
+            raise HTTPException(status_code=422, detail=f"{e} ({total} points inserted before its batch).")
+        total += n
+
+    async for chunk in request.stream():
+        pendente += chunk
+        if binario:
+            completos = len(pendente) // tamanho
+            if completos >= TAMANHO_LOTE:
+                # Copied out so the buffer can shrink
+                registros = np.frombuffer(pendente, dtype=REGISTRO_BINARIO, count=completos).copy()
+                del pendente[:completos * tamanho]
+                await insere(completos, _inserir_registros, registros, total)
+            continue
+
+        corte = pendente.rfind(b"\n")
+        if corte < 0:
+            continue
+        for linha in pendente[:corte].split(b"\n"):
+            linha_atual += 1
+            if linha.strip():
+                linhas.append((linha_atual, linha))
+        del pendente[:corte + 1]
+        if len(linhas) >= TAMANHO_LOTE:
+            await insere(len(linhas), _inserir_linhas, linhas)
+            linhas = []
+
+    if binario:
+        if len(pendente) % tamanho:
+            raise HTTPException(status_code=400, detail=f"Body is not a whole number of {tamanho}-byte records ({total} points inserted).")
+        completos = len(pendente) // tamanho
+        if completos:
+            await insere(completos, _inserir_registros, np.frombuffer(pendente, dtype=REGISTRO_BINARIO), total)
+    else:
+        if pendente.strip():
+            linhas.append((linha_atual + 1, pendente))
+        if linhas:
+            await insere(len(linhas), _inserir_linhas, linhas)
+
+    return {"message": f"{total} points inserted."}
+
+def _buscar_ndjson(arv, coords, n: int, campos: List[str], primeira: int) -> bytes:
+    with buscar_lote(coords, n, arv) as res:
+        tamanhos = res.tamanhos.tolist()
+        colunas = {}
+        for campo in campos:
+            if campo == "distancia":
+                colunas[campo] = res.distancias.tolist()
+            elif campo == "person_id":
+                colunas[campo] = [[pid.decode('utf-8', 'replace') for pid in linha] for linha in res.campo("person_id").tolist()]
+            else:
+                colunas[campo] = res.campo(campo).tolist()  # Only the requested fields are copied
+
+    linhas = []
+    for q, m in enumerate(tamanhos):
+        vizinhos = [{campo: colunas[campo][q][j] for campo in campos} for j in range(m)]
+        linhas.append(json.dumps({"consulta": primeira + q, "vizinhos": vizinhos}))
+    return ("\n".join(linhas) + "\n").encode()
+
+@app.post("/buscar-lote")
+def buscar_em_lote(consulta: ConsultaLote, campos: str = Query(",".join(c for c in CAMPOS_RESULTADO if c != "embedding"))):
+    """Streams one NDJSON line per query, in order; each chunk of TAMANHO_LOTE neighbours sees one snapshot."""
+    _check_lib_loaded()
+    selecionados = [c.strip() for c in campos.split(",") if c.strip()]
+    invalidos = [c for c in selecionados if c not in CAMPOS_RESULTADO]
+    if invalidos or not selecionados:
+        raise HTTPException(status_code=400, detail=f"Invalid fields {invalidos}; choose from {list(CAMPOS_RESULTADO)}.")
+
+    arv = lib.get_tree()
+    if not arv:
+        raise HTTPException(status_code=500, detail="KD-Tree not initialized. Use /construir-arvore first.")
+    coords = np.asarray(consulta.pontos, dtype=np.float64)
+    por_chunk = max(1, TAMANHO_LOTE // consulta.n)
+
+    # The first chunk runs before streaming starts, so an allocation failure can still be a 4xx
     try:
-        for i in range(c_results_array.size):
-            reg = c_results_array.elements[i]
-            results.append(PontoResultado(
-                lat=reg.lat,
-                lon=reg.lon,
-                person_id=reg.person_id.decode('utf-8'),
-                embedding=list(reg.embedding)
-            ))
-    finally:
-        lib.free_treg_array(c_results_array) # Release C-allocated memory
-
-    return results
+        primeiro = _buscar_ndjson(arv, coords[:por_chunk], consulta.n, selecionados, 0)
+    except MemoryError:
+        raise HTTPException(status_code=413, detail=f"Not enough memory for {consulta.n} neighbours per query.")
+
+    async def gera():
+        yield primeiro
+        for inicio in range(por_chunk, len(coords), por_chunk):
+            yield await run_in_threadpool(_buscar_ndjson, arv, coords[inicio:inicio + por_chunk], consulta.n, selecionados, inicio)
+
+    return StreamingResponse(gera(), media_type="application/x-ndjson")
+
+@app.get("/metrics", response_class=PlainTextResponse)
+def metrics():
+    """Search cost counters and latency histogram in Prometheus text format."""
+    _check_lib_loaded()
+    arv = lib.get_tree()
+    m = metricas(arv)
+    linhas = [
+        "# HELP kdtree_pontos Live points in the tree.",
+        "# TYPE kdtree_pontos gauge",
+        f"kdtree_pontos {lib.kdtree_tamanho(arv)}",
+    ]
+    for nome, valor, ajuda in (("nos_visitados", m.nos_visitados, "Nodes visited by nearest-neighbour searches."),
+                               ("distancias", m.distancias, "Distance evaluations."),
+                               ("operacoes_heap", m.operacoes_heap, "Insertions into the result max-heap.")):
+        linhas += [f"# HELP kdtree_{nome}_total {ajuda}", f"# TYPE kdtree_{nome}_total counter", f"kdtree_{nome}_total {valor}"]
+
+    linhas += ["# HELP kdtree_busca_segundos Wall time of each nearest-neighbour search.",
+               "# TYPE kdtree_busca_segundos histogram"]
+    # The per-reader counters are read one by one while searches run, so m.buscas can lag the
+    # buckets: +Inf and _count come from the histogram itself to keep the buckets monotone
+    acumulado = 0
+    for i in range(FAIXAS_LATENCIA - 1):
+        acumulado += m.histograma[i]
+        linhas.append(f'kdtree_busca_segundos_bucket{{le="{(2 ** i) / 1e6:g}"}} {acumulado}')
+    total = acumulado + m.histograma[FAIXAS_LATENCIA - 1]
+    linhas += [f'kdtree_busca_segundos_bucket{{le="+Inf"}} {total}',
+               f"kdtree_busca_segundos_sum {m.tempo_ns / 1e9:.9f}",
+               f"kdtree_busca_segundos_count {total}"]
+    return "\n".join(linhas) + "\n"
@@ -0,0 +1,80 @@
+"""Inserts/sec and queries/sec through the Python layer: per-element ctypes path vs. bulk NumPy path.
+
+Usage: python bench_wrapper.py [n_points] [n_queries]   (needs ./libkdtree.so)
+"""
+import sys
+import time
+from ctypes import c_char, c_float
+
+import numpy as np
+
+from kdtree_wrapper import lib, TReg, EMBEDDING_DIM, MAX_PERSON_ID_LEN, inserir_lote, buscar_lote
+
+N_PONTOS = int(sys.argv[1]) if len(sys.argv) > 1 else 50000
+N_CONSULTAS = int(sys.argv[2]) if len(sys.argv) > 2 else 5000
+K = 10
+
+
+def medir(nome, n, funcao):
+    inicio = time.perf_counter()
+    funcao()
+    tempo = time.perf_counter() - inicio
+    print(f"{nome:<48} {n / tempo:>12.0f} /s")
+
+
+def main():
+    if lib is None:
+        sys.exit("libkdtree.so not loaded")
+    rng = np.random.default_rng(42)
+    coords = rng.uniform(0, 100, (N_PONTOS, 2))
+    embeddings = rng.random((N_PONTOS, EMBEDDING_DIM), dtype=np.float32)
+    ids = [f"p{i}" for i in range(N_PONTOS)]
+    consultas = rng.uniform(0, 100, (N_CONSULTAS, 2))
+
+    # Same Python objects the API receives: floats in lists
+    coords_py = coords.tolist()
+    embeddings_py = embeddings.tolist()
+
+    def insere_por_elemento():
+        for (lat, lon), emb, pid in zip(coords_py, embeddings_py, ids):
+            c_embedding = (c_float * EMBEDDING_DIM)(*emb)
+            c_person_id = (c_char * MAX_PERSON_ID_LEN)()
+            for i, byte in enumerate(pid.encode("utf-8")[:MAX_PERSON_ID_LEN - 1]):
+                c_person_id[i] = byte
+            lib.inserir_ponto(lat, lon, c_embedding, c_person_id)
+
+    def busca_por_elemento():
+        arv = lib.get_tree()
+        for lat, lon in consultas.tolist():
+            query = TReg(lat=lat, lon=lon, person_id=b"query")
+            res = lib.buscar_n_mais_proximos(arv, query, K)
+            try:
+                [(res.elements[i].lat, res.elements[i].lon, res.elements[i].person_id.decode(), list(res.elements[i].embedding))
+                 for i in range(res.size)]
+            finally:
+                lib.free_treg_array(res)
+
+    def busca_lote_unitaria():
+        arv = lib.get_tree()
+        for consulta in consultas:
+            with buscar_lote(consulta, K, arv) as res:
+                regs = res.regs[0, :res.tamanhos[0]]
+                regs["lat"].tolist(), regs["lon"].tolist(), regs["person_id"].tolist(), regs["embedding"].tolist()
+
+    def busca_lote():
+        with buscar_lote(consultas, K) as res:
+            res.distancias.sum()
+
+    print(f"{N_PONTOS} points, {N_CONSULTAS} queries, k={K}")
+    lib.kdtree_construir()
+    medir("insert, per-element ctypes (before)", N_PONTOS, insere_por_elemento)
+    medir("query, TReg copy + list(embedding) (before)", N_CONSULTAS, busca_por_elemento)
+
+    lib.kdtree_construir()
+    medir("insert, inserir_lote (after)", N_PONTOS, lambda: inserir_lote(coords, embeddings, ids))
+    medir("query, buscar_lote one at a time + tolist (after)", N_CONSULTAS, busca_lote_unitaria)
+    medir("query, buscar_lote whole batch, views only (after)", N_CONSULTAS, busca_lote)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,123 @@
+"""Local load test for app.py: starts uvicorn on localhost and reports req/s and latency percentiles.
+
+Usage: python carga.py [n_points] [concurrency]   (needs ./libkdtree.so; no external services)
+"""
+import http.client
+import json
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+import numpy as np
+
+from app import REGISTRO_BINARIO
+from kdtree_wrapper import EMBEDDING_DIM
+
+N_PONTOS = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+CONCORRENCIA = int(sys.argv[2]) if len(sys.argv) > 2 else 8
+DURACAO = 3.0     # seconds per scenario
+LOTE = 10000      # points per /inserir-lote request
+CONSULTAS = 100   # queries per /buscar-lote request
+K = 10
+
+
+def porta_livre():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def inicia_servidor(porta):
+    proc = subprocess.Popen([sys.executable, "-m", "uvicorn", "app:app", "--port", str(porta), "--log-level", "warning"])
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", porta), timeout=0.1).close()
+            return proc
+        except OSError:
+            time.sleep(0.1)
+    proc.kill()
+    sys.exit("uvicorn did not start")
+
+
+def requisicao(conn, metodo, caminho, corpo=None, tipo="application/json"):
+    conn.request(metodo, caminho, body=corpo, headers={"Content-Type": tipo} if corpo is not None else {})
+    resp = conn.getresponse()
+    dados = resp.read()
+    if resp.status != 200:
+        raise RuntimeError(f"{metodo} {caminho}: {resp.status} {dados[:200]!r}")
+    return dados
+
+
+def cenario(porta, nome, gera_requisicao, itens_por_requisicao=1):
+    """Runs CONCORRENCIA clients with keep-alive connections for DURACAO seconds."""
+    latencias = [[] for _ in range(CONCORRENCIA)]
+    fim = time.perf_counter() + DURACAO
+
+    def cliente(i):
+        conn = http.client.HTTPConnection("127.0.0.1", porta)
+        rng = np.random.default_rng(i)
+        while time.perf_counter() < fim:
+            args = gera_requisicao(rng)
+            inicio = time.perf_counter()
+            requisicao(conn, *args)
+            latencias[i].append(time.perf_counter() - inicio)
+        conn.close()
+
+    threads = [threading.Thread(target=cliente, args=(i,)) for i in range(CONCORRENCIA)]
+    inicio = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    tempo = time.perf_counter() - inicio
+
+    todas = np.array([l for lista in latencias for l in lista]) * 1000
+    print(f"{nome:<50} {len(todas) / tempo:>9.0f} req/s {len(todas) * itens_por_requisicao / tempo:>10.0f} itens/s"
+          f"   p50 {np.percentile(todas, 50):7.2f} ms   p99 {np.percentile(todas, 99):7.2f} ms")
+
+
+def main():
+    porta = porta_livre()
+    servidor = inicia_servidor(porta)
+    try:
+        conn = http.client.HTTPConnection("127.0.0.1", porta)
+        requisicao(conn, "POST", "/construir-arvore")
+        rng = np.random.default_rng(0)
+
+        # Load: binary bulk inserts
+        inicio = time.perf_counter()
+        for base in range(0, N_PONTOS, LOTE):
+            n = min(LOTE, N_PONTOS - base)
+            regs = np.zeros(n, dtype=REGISTRO_BINARIO)
+            regs["lat"] = rng.uniform(0, 100, n)
+            regs["lon"] = rng.uniform(0, 100, n)
+            regs["embedding"] = rng.random((n, EMBEDDING_DIM), dtype=np.float32)
+            regs["person_id"] = [f"p{base + i}".encode() for i in range(n)]
+            requisicao(conn, "POST", "/inserir-lote", regs.tobytes(), "application/octet-stream")
+        print(f"Loaded {N_PONTOS} points via binary /inserir-lote: {N_PONTOS / (time.perf_counter() - inicio):.0f} points/s")
+        conn.close()
+        print(f"concurrency {CONCORRENCIA}, {DURACAO:.0f} s per scenario, k={K}")
+
+        def ponto_json(rng):
+            return json.dumps({"lat": float(rng.uniform(0, 100)), "lon": float(rng.uniform(0, 100)),
+                               "embedding": rng.random(EMBEDDING_DIM).tolist(), "person_id": f"c{rng.integers(1 << 62)}"})
+
+        cenario(porta, "POST /inserir", lambda rng: ("POST", "/inserir", ponto_json(rng)))
+        cenario(porta, "POST /inserir-lote (NDJSON, 100 points)",
+                lambda rng: ("POST", "/inserir-lote", "\n".join(ponto_json(rng) for _ in range(100)), "application/x-ndjson"), 100)
+        cenario(porta, "GET /buscar-n-vizinhos",
+                lambda rng: ("GET", f"/buscar-n-vizinhos?lat={rng.uniform(0, 100)}&lon={rng.uniform(0, 100)}&n={K}"))
+        cenario(porta, f"POST /buscar-lote ({CONSULTAS} queries, no embedding)",
+                lambda rng: ("POST", "/buscar-lote", json.dumps({"pontos": rng.uniform(0, 100, (CONSULTAS, 2)).tolist(), "n": K})), CONSULTAS)
+        cenario(porta, f"POST /buscar-lote ({CONSULTAS} queries, with embedding)",
+                lambda rng: ("POST", "/buscar-lote?campos=lat,lon,person_id,embedding,distancia",
+                             json.dumps({"pontos": rng.uniform(0, 100, (CONSULTAS, 2)).tolist(), "n": K})), CONSULTAS)
+    finally:
+        servidor.terminate()
+        servidor.wait()
+
+
+if __name__ == "__main__":
+    main()
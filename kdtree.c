@@ -3,10 +3,42 @@
 #include <float.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define EMBEDDING_DIM 128
 #define MAX_PERSON_ID_LEN 100
 
+#define SEED 0x12345678
+#define INDICE_BUCKETS_INICIAIS 1024
+#define INDICE_LOAD_FACTOR_THRESHOLD 0.7 // 70% de ocupação para redimensionar o índice
+
+// Limiares para a reconstrução automática da árvore
+#define LIMIAR_REMOVIDOS 0.25      // Fração de nós marcados como removidos
+#define FATOR_DESBALANCO 3.0       // Altura máxima tolerada em relação a log2(n)
+#define MIN_NOS_RECONSTRUCAO 64    // Árvores pequenas não são reconstruídas
+
+#define MAX_LEITORES 128 // Leitores que podem fixar uma versão ao mesmo tempo
+#define FAIXAS_LATENCIA 17 // Faixa i: busca com menos de 2^i us; a última acumula o resto
+
+// Versão da API estável (handle opaco); muda sempre que uma assinatura exportada mudar
+#define KDTREE_ABI_VERSAO 2
+
+// Snapshot em disco e log de escritas
+#define SNAPSHOT_MAGIC 0x5354444B // "KDTS"
+#define SNAPSHOT_VERSAO 1
+#define LOG_INSERE 1
+#define LOG_REMOVE 2
+#define LOG_ESVAZIA 3 // Descarta o snapshot e as entradas anteriores
+
 // Representa um ponto no espaço KD com dados associados
 typedef struct _reg {
     double lat;
@@ -61,16 +93,179 @@ typedef struct _node {
     void *key;
     struct _node *esq;
     struct _node *dir;
+    int removido;      // Tombstone: o nó continua orientando a descida, mas sai dos resultados
+    uint64_t geracao;  // Versão que criou o nó; só a versão em construção pode alterá-lo
 } tnode;
 
+// --- Índice person_id -> registro (hash com sondagem linear) ---
+typedef struct {
+    uintptr_t *table;
+    int size;
+    int max;
+    uintptr_t deleted;
+    int n_deleted;     // Posições marcadas como removidas; também contam na ocupação
+    char *(*get_key)(void *);
+    float load_factor_threshold;
+} thash;
+
+struct _arv;
+
+// Memória que saiu da versão publicada e só pode ser liberada depois da época indicada
+typedef struct _aposentado {
+    void *ptr;
+    void (*libera)(struct _arv *, void *);
+    uint64_t epoca;
+    struct _aposentado *prox;
+} taposentado;
+
+// Métricas acumuladas das buscas (_kdtree_busca_n_nearest)
+typedef struct {
+    uint64_t buscas;
+    uint64_t nos_visitados;
+    uint64_t distancias;      // Avaliações da função de distância
+    uint64_t operacoes_heap;  // Inserções no max-heap de resultados
+    uint64_t tempo_ns;        // Tempo de parede somado
+    uint64_t histograma[FAIXAS_LATENCIA];
+} tmetricas;
+
+// Época fixada por um leitor (0 = livre) e as métricas das buscas feitas nele.
+// Só o leitor que ocupa o slot escreve, então as métricas dispensam operações atômicas
+// de leitura-escrita; cada slot começa numa linha de cache própria.
+typedef struct {
+    _Alignas(64) uint64_t epoca;
+    tmetricas metricas;
+} tslot_leitor;
+
 // Estrutura da KD-Tree
 typedef struct _arv {
-    tnode *raiz;
+    tnode *raiz;                     // Raiz da versão publicada
     int (*cmp)(void *, void *, int); // Comparador de eixo
     double (*dist)(void *, void *);  // Função de distância para busca
     int k; // Dimensões da árvore (2 para lat/lon)
+    thash indice;          // person_id -> registro vivo
+    tnode *raiz_trabalho;  // Raiz da versão em construção pelo escritor
+    int n_nos;             // Nós na árvore, incluindo os removidos
+    int n_removidos;       // Nós marcados como removidos
+    int vivos;             // Pontos vivos da versão publicada, lido sem a trava
+    int altura;            // Maior profundidade atingida desde a última reconstrução
+    long nos_reconstruidos; // Nós percorridos por todas as reconstruções, totais ou de subárvores
+    pthread_mutex_t trava; // Serializa os escritores; leitores nunca bloqueiam
+    uint64_t geracao;      // Versão em construção pelo escritor
+    uint64_t epoca;        // Época global para a recuperação de memória
+    tslot_leitor leitores[MAX_LEITORES];
+    struct _aposentado *aposentados; // Memória esperando os leitores saírem
+    int indice_pendente;   // Índice ainda não construído após carregar um snapshot
+    void *mapa;            // Snapshot mapeado em memória (registros carregados)
+    size_t tam_mapa;
+    tnode *bloco;          // Nós carregados do snapshot, alocados num único bloco
+    int n_bloco;
+    FILE *log;             // Log de escritas desde o último snapshot
+    int reconstruindo;
+    int reconstrutor_iniciado;
+    pthread_t reconstrutor;
 } tarv;
 
+// Função de hash (Murmur hash)
+uint32_t hashf(const char *str, uint32_t h) {
+    for (; *str; ++str) {
+        h ^= *str;
+        h *= 0x5bd1e995;
+        h ^= h >> 15;
+    }
+    return h;
+}
+
+// Chave do índice: person_id do registro
+char *get_reg_person_id(void *reg) {
+    return ((treg *)reg)->person_id;
+}
+
+int hash_constroi(thash *h, int nbuckets, char *(*get_key)(void *), float load_factor_threshold) {
+    h->table = calloc(sizeof(void *), nbuckets + 1);
+    if (!h->table) return EXIT_FAILURE;
+    h->max = nbuckets + 1;
+    h->size = 0;
+    h->deleted = (uintptr_t)&(h->size);
+    h->n_deleted = 0;
+    h->get_key = get_key;
+    h->load_factor_threshold = load_factor_threshold;
+    return EXIT_SUCCESS;
+}
+
+// Dobra a tabela, ou só a refaz do mesmo tamanho quando a ocupação vem das marcas de removido
+int hash_resize(thash *h) {
+    int old_max = h->max;
+    uintptr_t *old_table = h->table;
+    int new_max = old_max;
+    if ((float)(h->size + 1) / (old_max - 1) >= h->load_factor_threshold / 2) new_max = (old_max - 1) * 2 + 1;
+    h->table = calloc(sizeof(void *), new_max);
+    if (!h->table) {
+        perror("Erro ao redimensionar o indice");
+        h->table = old_table;
+        return EXIT_FAILURE;
+    }
+    h->max = new_max;
+    h->size = 0;
+    h->n_deleted = 0;
+
+    for (int i = 0; i < old_max; i++) {
+        if (old_table[i] != 0 && old_table[i] != h->deleted) {
+            int pos = hashf(h->get_key((void *)old_table[i]), SEED) % h->max;
+            while (h->table[pos] != 0) pos = (pos + 1) % h->max;
+            h->table[pos] = old_table[i];
+            h->size++;
+        }
+    }
+    free(old_table);
+    return EXIT_SUCCESS;
+}
+
+int hash_insere(thash *h, void *bucket) {
+    if ((float)(h->size + h->n_deleted + 1) / (h->max - 1) >= h->load_factor_threshold) {
+        if (hash_resize(h) != EXIT_SUCCESS) return EXIT_FAILURE;
+    }
+    int pos = hashf(h->get_key(bucket), SEED) % h->max;
+    while (h->table[pos] != 0 && h->table[pos] != h->deleted) pos = (pos + 1) % h->max;
+    if (h->table[pos] == h->deleted) h->n_deleted--;
+    h->table[pos] = (uintptr_t)bucket;
+    h->size += 1;
+    return EXIT_SUCCESS;
+}
+
+void *hash_busca(thash h, const char *key) {
+    int pos = hashf(key, SEED) % h.max;
+    while (h.table[pos] != 0) {
+        if (h.table[pos] != h.deleted && strcmp(h.get_key((void *)h.table[pos]), key) == 0) {
+            return (void *)h.table[pos];
+        }
+        pos = (pos + 1) % h.max;
+    }
+    return NULL;
+}
+
+// Remove a entrada do índice; o registro pertence à árvore e não é liberado aqui
+int hash_remove(thash *h, const char *key) {
+    int pos = hashf(key, SEED) % h->max;
+    while (h->table[pos] != 0) {
+        if (h->table[pos] != h->deleted && strcmp(h->get_key((void *)h->table[pos]), key) == 0) {
+            h->table[pos] = h->deleted;
+            h->size--;
+            h->n_deleted++;
+            return EXIT_SUCCESS;
+        }
+        pos = (pos + 1) % h->max;
+    }
+    return EXIT_FAILURE;
+}
+
+void hash_apaga(thash *h) {
+    free(h->table);
+    h->table = NULL;
+    h->size = 0;
+    h->max = 0;
+    h->n_deleted = 0;
+}
+
 typedef struct _heap_element {
     double distance;
     treg *data;
@@ -143,52 +338,848 @@ void insert_into_max_heap(max_heap *heap, double distance, treg *data) {
     }
 }
 
+// Remove e retorna o elemento de maior distância
+heap_element extract_max_from_heap(max_heap *heap) {
+    heap_element max = heap->elements[0];
+    heap->size--;
+    heap->elements[0] = heap->elements[heap->size];
+    heapify_down(heap, 0);
+    return max;
+}
+
 void kdtree_constroi(tarv *arv, int (*cmp)(void *a, void *b, int), double (*dist)(void *, void *), int k) {
     arv->raiz = NULL;
     arv->cmp = cmp;
     arv->dist = dist;
     arv->k = k;
+    if (hash_constroi(&arv->indice, INDICE_BUCKETS_INICIAIS, get_reg_person_id, INDICE_LOAD_FACTOR_THRESHOLD) != EXIT_SUCCESS) {
+        perror("Index alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    arv->raiz_trabalho = NULL;
+    arv->n_nos = 0;
+    arv->n_removidos = 0;
+    arv->vivos = 0;
+    arv->altura = 0;
+    arv->nos_reconstruidos = 0;
+    pthread_mutex_init(&arv->trava, NULL);
+    arv->geracao = 1;
+    arv->epoca = 1;
+    memset(arv->leitores, 0, sizeof(arv->leitores));
+    arv->aposentados = NULL;
+    arv->indice_pendente = 0;
+    arv->mapa = NULL;
+    arv->tam_mapa = 0;
+    arv->bloco = NULL;
+    arv->n_bloco = 0;
+    arv->log = NULL;
+    arv->reconstruindo = 0;
+    arv->reconstrutor_iniciado = 0;
 }
 
-void _kdtree_insere(tnode **raiz, void *key, int (*cmp)(void *a, void *b, int), int profund, int k) {
-    if (!*raiz) {
-        *raiz = malloc(sizeof(tnode));
-        if (!*raiz) { perror("Node alloc failed"); exit(EXIT_FAILURE); }
-        (*raiz)->key = key;
-        (*raiz)->esq = NULL;
-        (*raiz)->dir = NULL;
-    } else {
-        int pos = profund % k;
-        if (cmp((*raiz)->key, key, pos) < 0) _kdtree_insere(&((*raiz)->dir), key, cmp, profund + 1, k);
-        else _kdtree_insere(&((*raiz)->esq), key, cmp, profund + 1, k);
+// --- Recuperação de memória por épocas ---
+// O leitor grava a época global num slot antes de ler a raiz. O que o escritor aposenta
+// recebe a época corrente e só é liberado quando todos os slots ocupados estão adiante dela.
+
+__thread int slot_preferido = -1; // Último slot usado pela thread, evita disputa entre leitores
+
+int _kdtree_fixa_epoca(tarv *arv) {
+    if (slot_preferido < 0) slot_preferido = (int)((((uint64_t)pthread_self() * 0x9E3779B97F4A7C15ULL) >> 32) % MAX_LEITORES);
+    for (;;) {
+        for (int i = 0; i < MAX_LEITORES; ++i) {
+            int slot = (slot_preferido + i) % MAX_LEITORES;
+            uint64_t livre = 0;
+            uint64_t epoca = __atomic_load_n(&arv->epoca, __ATOMIC_SEQ_CST);
+            if (__atomic_compare_exchange_n(&arv->leitores[slot].epoca, &livre, epoca, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                slot_preferido = slot;
+                return slot;
+            }
+        }
+        sched_yield(); // Todos os slots ocupados
+    }
+}
+
+void _kdtree_solta_epoca(tarv *arv, int slot) {
+    __atomic_store_n(&arv->leitores[slot].epoca, 0, __ATOMIC_RELEASE);
+}
+
+void _kdtree_aposenta(tarv *arv, void *ptr, void (*libera)(tarv *, void *)) {
+    taposentado *a = malloc(sizeof(taposentado));
+    if (!a) { perror("Retire alloc failed"); exit(EXIT_FAILURE); }
+    a->ptr = ptr;
+    a->libera = libera;
+    a->epoca = arv->epoca;
+    a->prox = arv->aposentados;
+    arv->aposentados = a;
+}
+
+// Libera o que nenhum leitor fixado ainda pode enxergar; forcar ignora os leitores
+void _kdtree_recolhe(tarv *arv, int forcar) {
+    uint64_t minima = UINT64_MAX;
+    if (!forcar) {
+        for (int i = 0; i < MAX_LEITORES; ++i) {
+            uint64_t e = __atomic_load_n(&arv->leitores[i].epoca, __ATOMIC_SEQ_CST);
+            if (e && e < minima) minima = e;
+        }
+    }
+    // A lista está em ordem decrescente de época: a partir do primeiro liberável, todos são
+    taposentado **p = &arv->aposentados;
+    while (*p && (*p)->epoca >= minima) p = &(*p)->prox;
+    taposentado *a = NULL;
+    // Libera da mais antiga para a mais nova: uma árvore esvaziada leva junto o bloco
+    // de nós do snapshot que aposentadorias anteriores ainda percorrem
+    for (taposentado *q = *p; q;) {
+        taposentado *prox = q->prox;
+        q->prox = a;
+        a = q;
+        q = prox;
     }
+    *p = NULL;
+    while (a) {
+        taposentado *prox = a->prox;
+        a->libera(arv, a->ptr);
+        free(a);
+        a = prox;
+    }
+}
+
+int _kdtree_no_do_bloco(tarv *arv, tnode *no) {
+    return arv->bloco && no >= arv->bloco && no < arv->bloco + arv->n_bloco;
+}
+
+void _kdtree_libera_no(tarv *arv, void *no) {
+    (void)arv;
+    free(no);
+}
+
+void _kdtree_libera_reg(tarv *arv, void *reg) {
+    (void)arv;
+    free(reg);
+}
+
+// Árvore aposentada inteira. Registros e nós vindos do snapshot pertencem ao mapa e ao bloco,
+// não ao malloc; os limites são guardados aqui porque a árvore pode ter sido esvaziada depois
+typedef struct {
+    tnode *raiz;
+    int todos;            // Libera todos os registros, não só os removidos
+    int libera_snapshot;  // Desfaz também o mapa e o bloco
+    void *mapa;
+    size_t tam_mapa;
+    tnode *bloco;
+    int n_bloco;
+} tarvore_aposentada;
+
+void _kdtree_libera_nos(tarvore_aposentada *a, tnode *node) {
+    if (!node) return;
+    _kdtree_libera_nos(a, node->esq);
+    _kdtree_libera_nos(a, node->dir);
+    char *reg = node->key;
+    if ((a->todos || node->removido) && !(a->mapa && reg >= (char *)a->mapa && reg < (char *)a->mapa + a->tam_mapa)) free(reg);
+    if (!(a->bloco && node >= a->bloco && node < a->bloco + a->n_bloco)) free(node);
+}
+
+void _kdtree_libera_aposentada(tarv *arv, void *ptr) {
+    (void)arv;
+    tarvore_aposentada *a = ptr;
+    _kdtree_libera_nos(a, a->raiz);
+    if (a->libera_snapshot) {
+        free(a->bloco);
+        if (a->mapa) munmap(a->mapa, a->tam_mapa);
+    }
+    free(a);
+}
+
+void _kdtree_aposenta_arvore(tarv *arv, tnode *raiz, int todos, int libera_snapshot) {
+    tarvore_aposentada *a = malloc(sizeof(tarvore_aposentada));
+    if (!a) { perror("Retire alloc failed"); exit(EXIT_FAILURE); }
+    *a = (tarvore_aposentada){ raiz, todos, libera_snapshot, arv->mapa, arv->tam_mapa, arv->bloco, arv->n_bloco };
+    _kdtree_aposenta(arv, a, _kdtree_libera_aposentada);
+}
+
+// Torna a versão em construção visível aos leitores e inicia a próxima
+void _kdtree_publica(tarv *arv) {
+    __atomic_store_n(&arv->raiz, arv->raiz_trabalho, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&arv->vivos, arv->n_nos - arv->n_removidos, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&arv->epoca, 1, __ATOMIC_SEQ_CST);
+    arv->geracao++;
+    if (arv->aposentados) _kdtree_recolhe(arv, 0);
+}
+
+// --- Cópia de caminho ---
+tnode *_kdtree_novo_no(tarv *arv, void *key) {
+    tnode *novo = malloc(sizeof(tnode));
+    if (!novo) { perror("Node alloc failed"); exit(EXIT_FAILURE); }
+    novo->key = key;
+    novo->esq = NULL;
+    novo->dir = NULL;
+    novo->removido = 0;
+    novo->geracao = arv->geracao;
+    return novo;
+}
+
+// Devolve uma versão alterável do nó: ele mesmo, se ainda não foi publicado, ou uma cópia
+tnode *_kdtree_copia(tarv *arv, tnode *node) {
+    if (node->geracao == arv->geracao) return node;
+    tnode *copia = malloc(sizeof(tnode));
+    if (!copia) { perror("Node alloc failed"); exit(EXIT_FAILURE); }
+    *copia = *node;
+    copia->geracao = arv->geracao;
+    // Nós do bloco só são liberados com o bloco inteiro
+    if (!_kdtree_no_do_bloco(arv, node)) _kdtree_aposenta(arv, node, _kdtree_libera_no);
+    return copia;
+}
+
+// Insere copiando o caminho; a profundidade do novo nó é devolvida em *altura
+tnode *_kdtree_insere(tarv *arv, tnode *node, void *key, int profund, int *altura) {
+    if (!node) {
+        *altura = profund;
+        return _kdtree_novo_no(arv, key);
+    }
+    tnode *copia = _kdtree_copia(arv, node);
+    int pos = profund % arv->k;
+    if (arv->cmp(copia->key, key, pos) < 0) copia->dir = _kdtree_insere(arv, copia->dir, key, profund + 1, altura);
+    else copia->esq = _kdtree_insere(arv, copia->esq, key, profund + 1, altura);
+    return copia;
+}
+
+// Copia o caminho até o nó que guarda reg e marca a cópia como removida
+tnode *_kdtree_marca_caminho(tarv *arv, tnode *node, void *reg, int profund, int *achou) {
+    if (!node) return NULL;
+    if (node->key == reg) {
+        tnode *copia = _kdtree_copia(arv, node);
+        copia->removido = 1;
+        *achou = 1;
+        return copia;
+    }
+    // Iguais no eixo podem estar dos dois lados depois de uma reconstrução
+    int comp = arv->cmp(node->key, reg, profund % arv->k);
+    if (comp >= 0) {
+        tnode *esq = _kdtree_marca_caminho(arv, node->esq, reg, profund + 1, achou);
+        if (*achou) {
+            tnode *copia = _kdtree_copia(arv, node);
+            copia->esq = esq;
+            return copia;
+        }
+    }
+    if (comp <= 0) {
+        tnode *dir = _kdtree_marca_caminho(arv, node->dir, reg, profund + 1, achou);
+        if (*achou) {
+            tnode *copia = _kdtree_copia(arv, node);
+            copia->dir = dir;
+            return copia;
+        }
+    }
+    return node;
+}
+
+// --- Reconstrução balanceada ---
+void _kdtree_coleta_vivos(tnode *node, void **regs, int *n) {
+    if (!node) return;
+    if (!node->removido) regs[(*n)++] = node->key;
+    _kdtree_coleta_vivos(node->esq, regs, n);
+    _kdtree_coleta_vivos(node->dir, regs, n);
+}
+
+// Quickselect: deixa em v[m] o elemento de ordem m no eixo pos
+void _kdtree_seleciona(void **v, int n, int m, int (*cmp)(void *, void *, int), int pos) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        void *pivo = v[(lo + hi) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (cmp(v[i], pivo, pos) < 0) i++;
+            while (cmp(v[j], pivo, pos) > 0) j--;
+            if (i <= j) {
+                void *tmp = v[i];
+                v[i] = v[j];
+                v[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        if (m <= j) hi = j;
+        else if (m >= i) lo = i;
+        else break;
+    }
+}
+
+tnode *_kdtree_constroi_balanceada(tarv *arv, void **regs, int n, int profund, int *altura) {
+    if (n <= 0) return NULL;
+    int m = n / 2;
+    _kdtree_seleciona(regs, n, m, arv->cmp, profund % arv->k);
+
+    tnode *no = _kdtree_novo_no(arv, regs[m]);
+    if (profund > *altura) *altura = profund;
+    no->esq = _kdtree_constroi_balanceada(arv, regs, m, profund + 1, altura);
+    no->dir = _kdtree_constroi_balanceada(arv, regs + m + 1, n - m - 1, profund + 1, altura);
+    return no;
+}
+
+// Libera os nós de uma árvore substituída; os registros vivos foram reaproveitados pela nova
+void _kdtree_indexa(thash *indice, tnode *node) {
+    if (!node) return;
+    if (!node->removido && hash_insere(indice, node->key) != EXIT_SUCCESS) {
+        perror("Index insert failed");
+        exit(EXIT_FAILURE);
+    }
+    _kdtree_indexa(indice, node->esq);
+    _kdtree_indexa(indice, node->dir);
+}
+
+// Refaz o índice do zero, descartando as marcas de removido acumuladas
+void _kdtree_reindexa(tarv *arv, int vivos) {
+    int buckets = 2 * vivos > INDICE_BUCKETS_INICIAIS ? 2 * vivos : INDICE_BUCKETS_INICIAIS;
+    hash_apaga(&arv->indice);
+    if (hash_constroi(&arv->indice, buckets, get_reg_person_id, INDICE_LOAD_FACTOR_THRESHOLD) != EXIT_SUCCESS) {
+        perror("Index rebuild failed");
+        exit(EXIT_FAILURE);
+    }
+    _kdtree_indexa(&arv->indice, arv->raiz_trabalho);
+}
+
+// Reconstrói a árvore balanceada só com os nós vivos. Chamada com a trava dos escritores;
+// a árvore antiga é aposentada inteira e as buscas em andamento terminam nela.
+void _kdtree_reconstroi(tarv *arv) {
+    int vivos = arv->n_nos - arv->n_removidos;
+    void **regs = malloc(sizeof(void *) * (vivos > 0 ? vivos : 1));
+    if (!regs) { perror("Rebuild alloc failed"); return; }
+    int n = 0;
+    _kdtree_coleta_vivos(arv->raiz_trabalho, regs, &n);
+
+    int altura = 0;
+    tnode *antiga = arv->raiz_trabalho;
+    arv->raiz_trabalho = _kdtree_constroi_balanceada(arv, regs, n, 0, &altura);
+    free(regs);
+
+    if (antiga) _kdtree_aposenta_arvore(arv, antiga, 0, 0);
+    _kdtree_publica(arv);
+    if (!arv->indice_pendente) _kdtree_reindexa(arv, n);
+
+    arv->n_nos = n;
+    arv->n_removidos = 0;
+    arv->altura = altura;
+    arv->nos_reconstruidos += n;
+}
+
+void *_kdtree_reconstroi_thread(void *arg) {
+    tarv *arv = arg;
+    pthread_mutex_lock(&arv->trava);
+    _kdtree_reconstroi(arv);
+    arv->reconstruindo = 0;
+    pthread_mutex_unlock(&arv->trava);
+    return NULL;
+}
+
+// Dispara a reconstrução em segundo plano se houver removidos demais ou a árvore estiver desbalanceada
+void _kdtree_verifica_reconstrucao(tarv *arv) {
+    if (arv->reconstruindo || arv->n_nos < MIN_NOS_RECONSTRUCAO) return;
+    int vivos = arv->n_nos - arv->n_removidos;
+    int muitos_removidos = arv->n_removidos > LIMIAR_REMOVIDOS * arv->n_nos;
+    int desbalanceada = arv->altura > FATOR_DESBALANCO * log2(vivos + 1);
+    if (!muitos_removidos && !desbalanceada) return;
+
+    // A thread anterior já terminou (reconstruindo == 0), só falta recolhê-la
+    if (arv->reconstrutor_iniciado) pthread_join(arv->reconstrutor, NULL);
+    arv->reconstrutor_iniciado = 0;
+    arv->reconstruindo = 1;
+    if (pthread_create(&arv->reconstrutor, NULL, _kdtree_reconstroi_thread, arv) != 0) {
+        arv->reconstruindo = 0; // Tenta de novo na próxima escrita
+        return;
+    }
+    arv->reconstrutor_iniciado = 1;
+}
+
+// Espera a reconstrução em segundo plano, se houver uma em andamento
+void kdtree_aguarda_reconstrucao(tarv *arv) {
+    pthread_mutex_lock(&arv->trava);
+    int iniciado = arv->reconstrutor_iniciado;
+    pthread_t reconstrutor = arv->reconstrutor;
+    arv->reconstrutor_iniciado = 0;
+    pthread_mutex_unlock(&arv->trava);
+    if (iniciado) pthread_join(reconstrutor, NULL);
+}
+
+// --- Escrita (sempre com a trava adquirida) ---
+// Depois de carregar um snapshot o índice só é montado na primeira escrita,
+// para que as buscas não esperem por ele
+void _kdtree_garante_indice(tarv *arv) {
+    if (!arv->indice_pendente) return;
+    _kdtree_indexa(&arv->indice, arv->raiz_trabalho);
+    arv->indice_pendente = 0;
+}
+
+void _kdtree_registra(tarv *arv, uint32_t op, treg *reg) {
+    if (!arv->log) return;
+    uint32_t cab[2] = { op, 0 };
+    if (fwrite(cab, sizeof(cab), 1, arv->log) != 1 || fwrite(reg, sizeof(treg), 1, arv->log) != 1 || fflush(arv->log) != 0) {
+        perror("Log write failed");
+    }
+}
+
+void _kdtree_marca_removido(tarv *arv, treg *reg) {
+    int achou = 0;
+    hash_remove(&arv->indice, reg->person_id);
+    arv->raiz_trabalho = _kdtree_marca_caminho(arv, arv->raiz_trabalho, reg, 0, &achou);
+    assert(achou);
+    arv->n_removidos++;
+}
+
+int _kdtree_conta(tnode *node) {
+    return node ? 1 + _kdtree_conta(node->esq) + _kdtree_conta(node->dir) : 0;
+}
+
+// O nó com key ficou fundo demais (bode expiatório): sobe pelo caminho até o primeiro ancestral
+// em que o filho do caminho tem mais de 2^(-1/FATOR_DESBALANCO) dos nós e reconstrói só essa
+// subárvore. A inserção já copiou o caminho, então ele pode ser alterado no lugar.
+// Retorna a maior profundidade da subárvore reconstruída.
+int _kdtree_rebalanceia(tarv *arv, void *key, int profund) {
+    tnode **caminho = malloc(sizeof(tnode *) * (profund + 1));
+    if (!caminho) { perror("Rebalance alloc failed"); return profund; }
+    tnode *node = arv->raiz_trabalho;
+    for (int d = 0; d < profund; ++d) {
+        caminho[d] = node;
+        node = arv->cmp(node->key, key, d % arv->k) < 0 ? node->dir : node->esq;
+    }
+    caminho[profund] = node;
+    assert(node->key == key);
+
+    double alfa = pow(2.0, -1.0 / FATOR_DESBALANCO);
+    int tam = 1, altura = profund;
+    for (int d = profund - 1; d >= 0; --d) {
+        tnode *pai = caminho[d];
+        tnode *irmao = pai->esq == caminho[d + 1] ? pai->dir : pai->esq;
+        int tam_pai = tam + 1 + _kdtree_conta(irmao);
+        if (tam <= alfa * tam_pai) {
+            tam = tam_pai;
+            continue;
+        }
+
+        void **regs = malloc(sizeof(void *) * tam_pai);
+        if (!regs) { perror("Rebalance alloc failed"); break; }
+        int n = 0;
+        _kdtree_coleta_vivos(pai, regs, &n);
+        altura = d;
+        tnode *nova = _kdtree_constroi_balanceada(arv, regs, n, d, &altura);
+        free(regs);
+        if (d == 0) arv->raiz_trabalho = nova;
+        else if (caminho[d - 1]->esq == pai) caminho[d - 1]->esq = nova;
+        else caminho[d - 1]->dir = nova;
+        // Os removidos da subárvore saem junto com os nós antigos
+        _kdtree_aposenta_arvore(arv, pai, 0, 0);
+        arv->n_nos -= tam_pai - n;
+        arv->n_removidos -= tam_pai - n;
+        arv->nos_reconstruidos += tam_pai;
+        break;
+    }
+    free(caminho);
+    return altura;
+}
+
+// Insere na versão em construção; um person_id já existente é substituído
+void _kdtree_insere_indexado(tarv *arv, void *key) {
+    _kdtree_garante_indice(arv);
+    treg *antigo = hash_busca(arv->indice, ((treg *)key)->person_id);
+    if (antigo) _kdtree_marca_removido(arv, antigo);
+
+    int altura = 0;
+    arv->raiz_trabalho = _kdtree_insere(arv, arv->raiz_trabalho, key, 0, &altura);
+    if (hash_insere(&arv->indice, key) != EXIT_SUCCESS) {
+        perror("Index insert failed");
+        exit(EXIT_FAILURE);
+    }
+    arv->n_nos++;
+    if (altura > FATOR_DESBALANCO * log2(arv->n_nos + 1)) altura = _kdtree_rebalanceia(arv, key, altura);
+    if (altura > arv->altura) arv->altura = altura;
 }
 
 // Insere um ponto na KD-Tree
 void kdtree_insere(tarv *arv, void *key) {
-    _kdtree_insere(&(arv->raiz), key, arv->cmp, 0, arv->k);
+    pthread_mutex_lock(&arv->trava);
+    _kdtree_insere_indexado(arv, key);
+    _kdtree_registra(arv, LOG_INSERE, key);
+    _kdtree_publica(arv);
+    _kdtree_verifica_reconstrucao(arv);
+    pthread_mutex_unlock(&arv->trava);
 }
 
-void _kdtree_destroi(tnode *node) {
-    if (node) {
-        _kdtree_destroi(node->esq);
-        _kdtree_destroi(node->dir);
-        free(node->key);
-        free(node);
+// Remove (logicamente) o ponto com o person_id dado
+int kdtree_remove(tarv *arv, const char *person_id) {
+    pthread_mutex_lock(&arv->trava);
+    _kdtree_garante_indice(arv);
+    treg *reg = hash_busca(arv->indice, person_id);
+    if (!reg) {
+        pthread_mutex_unlock(&arv->trava);
+        return EXIT_FAILURE;
+    }
+    _kdtree_marca_removido(arv, reg);
+    _kdtree_registra(arv, LOG_REMOVE, reg);
+    _kdtree_publica(arv);
+    _kdtree_verifica_reconstrucao(arv);
+    pthread_mutex_unlock(&arv->trava);
+    return EXIT_SUCCESS;
+}
+
+// Move o ponto para (lat, lon); embedding NULL mantém o embedding atual
+int kdtree_atualiza(tarv *arv, const char *person_id, double lat, double lon, float *embedding) {
+    pthread_mutex_lock(&arv->trava);
+    _kdtree_garante_indice(arv);
+    treg *antigo = hash_busca(arv->indice, person_id);
+    if (!antigo) {
+        pthread_mutex_unlock(&arv->trava);
+        return EXIT_FAILURE;
+    }
+    treg *novo = aloca_reg(lat, lon, embedding ? embedding : antigo->embedding, antigo->person_id);
+    _kdtree_insere_indexado(arv, novo);
+    _kdtree_registra(arv, LOG_INSERE, novo);
+    _kdtree_publica(arv);
+    _kdtree_verifica_reconstrucao(arv);
+    pthread_mutex_unlock(&arv->trava);
+    return EXIT_SUCCESS;
+}
+
+// person_id do i-ésimo ponto do lote, com no máximo MAX_PERSON_ID_LEN - 1 bytes
+void _kdtree_id_lote(const char *ids, int i, int id_stride, char *id) {
+    const char *origem = ids + (size_t)i * id_stride;
+    size_t len = strnlen(origem, id_stride < MAX_PERSON_ID_LEN - 1 ? id_stride : MAX_PERSON_ID_LEN - 1);
+    memcpy(id, origem, len);
+    id[len] = '\0';
+}
+
+// Lote pelo menos do tamanho da árvore: junta os vivos e o lote numa árvore balanceada nova,
+// em vez de inserir ponto a ponto. Um person_id repetido fica com o último do lote.
+void _kdtree_insere_lote_balanceado(tarv *arv, int n, const double *coords, const float *embeddings, const char *ids, int id_stride) {
+    char id[MAX_PERSON_ID_LEN];
+    _kdtree_garante_indice(arv);
+
+    // De trás para frente, pulando ids já vistos: só o último de cada id é alocado
+    thash lote;
+    treg **novos = malloc(sizeof(treg *) * n);
+    if (!novos || hash_constroi(&lote, 2 * n, get_reg_person_id, INDICE_LOAD_FACTOR_THRESHOLD) != EXIT_SUCCESS) {
+        perror("Batch alloc failed");
+        exit(EXIT_FAILURE);
     }
+    int m = 0;
+    for (int i = n - 1; i >= 0; --i) {
+        _kdtree_id_lote(ids, i, id_stride, id);
+        if (hash_busca(lote, id)) continue;
+        treg *reg = aloca_reg(coords[2 * i], coords[2 * i + 1], (float *)embeddings + (size_t)i * EMBEDDING_DIM, id);
+        if (hash_insere(&lote, reg) != EXIT_SUCCESS) { perror("Batch index insert failed"); exit(EXIT_FAILURE); }
+        novos[m++] = reg;
+    }
+    hash_apaga(&lote);
+
+    for (int j = m - 1; j >= 0; --j) {
+        treg *antigo = hash_busca(arv->indice, novos[j]->person_id);
+        if (antigo) {
+            // Vivo na árvore antiga, que não libera os vivos ao ser aposentada
+            hash_remove(&arv->indice, antigo->person_id);
+            char *p = (char *)antigo;
+            if (!(arv->mapa && p >= (char *)arv->mapa && p < (char *)arv->mapa + arv->tam_mapa)) _kdtree_aposenta(arv, antigo, _kdtree_libera_reg);
+        }
+        if (hash_insere(&arv->indice, novos[j]) != EXIT_SUCCESS) { perror("Index insert failed"); exit(EXIT_FAILURE); }
+        _kdtree_registra(arv, LOG_INSERE, novos[j]);
+    }
+    free(novos);
+
+    // O índice tem exatamente os pontos vivos
+    void **regs = malloc(sizeof(void *) * (arv->indice.size > 0 ? arv->indice.size : 1));
+    if (!regs) { perror("Batch alloc failed"); exit(EXIT_FAILURE); }
+    int total = 0;
+    for (int i = 0; i < arv->indice.max; ++i) {
+        if (arv->indice.table[i] != 0 && arv->indice.table[i] != arv->indice.deleted) regs[total++] = (void *)arv->indice.table[i];
+    }
+    int altura = 0;
+    tnode *antiga = arv->raiz_trabalho;
+    arv->raiz_trabalho = _kdtree_constroi_balanceada(arv, regs, total, 0, &altura);
+    free(regs);
+    if (antiga) _kdtree_aposenta_arvore(arv, antiga, 0, 0);
+    _kdtree_reindexa(arv, total);
+
+    arv->n_nos = total;
+    arv->n_removidos = 0;
+    arv->altura = altura;
+    arv->nos_reconstruidos += total;
 }
 
+// Insere n pontos com uma única publicação. Os buffers são contíguos: coords n×2 (lat, lon),
+// embeddings n×EMBEDDING_DIM e ids n×id_stride bytes, terminados em '\0' ou completos
+void kdtree_insere_lote(tarv *arv, int n, const double *coords, const float *embeddings, const char *ids, int id_stride) {
+    char id[MAX_PERSON_ID_LEN];
+    pthread_mutex_lock(&arv->trava);
+    if (n > 0 && n >= arv->n_nos - arv->n_removidos) {
+        _kdtree_insere_lote_balanceado(arv, n, coords, embeddings, ids, id_stride);
+    } else {
+        // Lote pequeno: a cópia de caminho rebalanceia as subárvores a cada inserção
+        for (int i = 0; i < n; ++i) {
+            _kdtree_id_lote(ids, i, id_stride, id);
+            treg *reg = aloca_reg(coords[2 * i], coords[2 * i + 1], (float *)embeddings + (size_t)i * EMBEDDING_DIM, id);
+            _kdtree_insere_indexado(arv, reg);
+            _kdtree_registra(arv, LOG_INSERE, reg);
+        }
+    }
+    _kdtree_publica(arv);
+    _kdtree_verifica_reconstrucao(arv);
+    pthread_mutex_unlock(&arv->trava);
+}
+
+// Não pode haver leitores com versão fixada
 void kdtree_destroi(tarv *arv) {
-    _kdtree_destroi(arv->raiz);
+    kdtree_aguarda_reconstrucao(arv);
+    tarvore_aposentada atual = { arv->raiz, 1, 0, arv->mapa, arv->tam_mapa, arv->bloco, arv->n_bloco };
+    _kdtree_libera_nos(&atual, arv->raiz);
+    arv->raiz = NULL;
+    arv->raiz_trabalho = NULL;
+    _kdtree_recolhe(arv, 1);
+    hash_apaga(&arv->indice);
+    free(arv->bloco);
+    arv->bloco = NULL;
+    if (arv->mapa) munmap(arv->mapa, arv->tam_mapa);
+    arv->mapa = NULL;
+    if (arv->log) fclose(arv->log);
+    arv->log = NULL;
+    pthread_mutex_destroy(&arv->trava);
 }
 
+// Esvazia uma árvore em uso sem reiniciar a trava nem os slots dos leitores;
+// a versão atual é aposentada inteira, com o snapshot mapeado, e as buscas em andamento terminam nela.
+// O log passa a conter só o esvaziamento, que descarta o snapshot ao ser reaplicado.
+void kdtree_esvazia(tarv *arv) {
+    pthread_mutex_lock(&arv->trava);
+    if (arv->raiz_trabalho || arv->mapa) _kdtree_aposenta_arvore(arv, arv->raiz_trabalho, 1, 1);
+    arv->raiz_trabalho = NULL;
+    arv->mapa = NULL;
+    arv->tam_mapa = 0;
+    arv->bloco = NULL;
+    arv->n_bloco = 0;
+    if (arv->log) {
+        treg vazio = {0};
+        if (ftruncate(fileno(arv->log), 0) != 0) perror("Log truncate failed");
+        _kdtree_registra(arv, LOG_ESVAZIA, &vazio);
+    }
+    arv->n_nos = 0;
+    arv->n_removidos = 0;
+    _kdtree_publica(arv);
+    _kdtree_reindexa(arv, 0);
+    arv->indice_pendente = 0;
+    arv->altura = 0;
+    pthread_mutex_unlock(&arv->trava);
+}
+
+// --- Persistência: snapshot mapeável e log de escritas ---
+// Arquivo: cabeçalho | nós (índices dos filhos, em pré-ordem) | registros (mesma ordem dos nós)
+typedef struct {
+    uint32_t magic;
+    uint32_t versao;
+    int32_t k;
+    int32_t n;
+    int32_t altura;
+    int32_t reservado;
+    uint64_t off_nos;
+    uint64_t off_regs;
+} tsnapshot_cab;
+
+typedef struct {
+    int32_t esq; // -1 = sem filho
+    int32_t dir;
+} tno_plano;
+
+// Achata os registros numa árvore balanceada; retorna o índice da raiz da subárvore
+int _kdtree_achata(tarv *arv, void **regs, int n, int profund, tno_plano *nos, void **ordem, int *prox, int *altura) {
+    if (n <= 0) return -1;
+    int m = n / 2;
+    _kdtree_seleciona(regs, n, m, arv->cmp, profund % arv->k);
+
+    int i = (*prox)++;
+    ordem[i] = regs[m];
+    if (profund > *altura) *altura = profund;
+    nos[i].esq = _kdtree_achata(arv, regs, m, profund + 1, nos, ordem, prox, altura);
+    nos[i].dir = _kdtree_achata(arv, regs + m + 1, n - m - 1, profund + 1, nos, ordem, prox, altura);
+    return i;
+}
+
+// Grava os pontos vivos em caminho e zera o log. Os escritores esperam; as buscas não.
+int kdtree_salva(tarv *arv, const char *caminho) {
+    pthread_mutex_lock(&arv->trava);
+    int vivos = arv->n_nos - arv->n_removidos;
+    void **regs = malloc(sizeof(void *) * (vivos > 0 ? vivos : 1));
+    void **ordem = malloc(sizeof(void *) * (vivos > 0 ? vivos : 1));
+    tno_plano *nos = malloc(sizeof(tno_plano) * (vivos > 0 ? vivos : 1));
+    char *tmp = malloc(strlen(caminho) + 5);
+    FILE *f = NULL;
+    int status = EXIT_FAILURE;
+    if (!regs || !ordem || !nos || !tmp) { perror("Snapshot alloc failed"); goto fim; }
+
+    int n = 0, prox = 0, altura = 0;
+    _kdtree_coleta_vivos(arv->raiz_trabalho, regs, &n);
+    _kdtree_achata(arv, regs, n, 0, nos, ordem, &prox, &altura);
+
+    tsnapshot_cab cab = { SNAPSHOT_MAGIC, SNAPSHOT_VERSAO, arv->k, n, altura, 0, 0, 0 };
+    cab.off_nos = sizeof(tsnapshot_cab);
+    cab.off_regs = (cab.off_nos + sizeof(tno_plano) * n + 63) & ~(uint64_t)63;
+
+    sprintf(tmp, "%s.tmp", caminho);
+    f = fopen(tmp, "wb");
+    if (!f) { perror("Snapshot open failed"); goto fim; }
+    static const char zeros[64] = {0};
+    size_t pad = cab.off_regs - cab.off_nos - sizeof(tno_plano) * n;
+    if (fwrite(&cab, sizeof(cab), 1, f) != 1 ||
+        fwrite(nos, sizeof(tno_plano), n, f) != (size_t)n ||
+        fwrite(zeros, 1, pad, f) != pad) { perror("Snapshot write failed"); goto fim; }
+    for (int i = 0; i < n; ++i) {
+        if (fwrite(ordem[i], sizeof(treg), 1, f) != 1) { perror("Snapshot write failed"); goto fim; }
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) { perror("Snapshot sync failed"); goto fim; }
+    fclose(f);
+    f = NULL;
+    if (rename(tmp, caminho) != 0) { perror("Snapshot rename failed"); goto fim; }
+
+    // O snapshot já contém tudo o que estava no log
+    if (arv->log && ftruncate(fileno(arv->log), 0) != 0) perror("Log truncate failed");
+    status = EXIT_SUCCESS;
+
+fim:
+    if (f) { fclose(f); remove(tmp); }
+    free(regs);
+    free(ordem);
+    free(nos);
+    free(tmp);
+    pthread_mutex_unlock(&arv->trava);
+    return status;
+}
+
+// Confere o cabeçalho, que cada nó tem um único pai com índice menor (pré-ordem a partir da raiz 0)
+// e que os registros têm coordenadas finitas e person_id terminado em '\0'
+int _kdtree_snapshot_valido(tarv *arv, void *mapa, size_t tam) {
+    tsnapshot_cab *cab = mapa;
+    if (cab->magic != SNAPSHOT_MAGIC || cab->versao != SNAPSHOT_VERSAO || cab->k != arv->k || cab->n < 0) return 0;
+    if (cab->off_nos % _Alignof(tno_plano) != 0 || cab->off_regs % _Alignof(treg) != 0) return 0;
+    if (cab->off_nos > tam || (tam - cab->off_nos) / sizeof(tno_plano) < (uint64_t)cab->n) return 0;
+    if (cab->off_regs > tam || (tam - cab->off_regs) / sizeof(treg) < (uint64_t)cab->n) return 0;
+
+    int n = cab->n;
+    tno_plano *nos = (tno_plano *)((char *)mapa + cab->off_nos);
+    treg *regs = (treg *)((char *)mapa + cab->off_regs);
+    char *tem_pai = calloc(n > 0 ? n : 1, 1);
+    if (!tem_pai) { perror("Snapshot check alloc failed"); return 0; }
+    int valido = 1, filhos = 0;
+    for (int i = 0; i < n && valido; ++i) {
+        int32_t lados[2] = { nos[i].esq, nos[i].dir };
+        for (int j = 0; j < 2 && valido; ++j) {
+            if (lados[j] == -1) continue;
+            if (lados[j] <= i || lados[j] >= n || tem_pai[lados[j]]) valido = 0;
+            else { tem_pai[lados[j]] = 1; filhos++; }
+        }
+        if (!isfinite(regs[i].lat) || !isfinite(regs[i].lon) || !memchr(regs[i].person_id, 0, MAX_PERSON_ID_LEN)) valido = 0;
+    }
+    free(tem_pai);
+    return valido && filhos == (n > 0 ? n - 1 : 0);
+}
+
+// Mapeia o snapshot em memória e publica-o como a versão atual de uma árvore vazia.
+// Os registros são usados direto do mapa; só os nós são montados, num único bloco.
+int kdtree_carrega(tarv *arv, const char *caminho) {
+    pthread_mutex_lock(&arv->trava);
+    if (arv->raiz_trabalho || arv->mapa) {
+        fprintf(stderr, "Snapshot must be loaded into an empty tree\n");
+        pthread_mutex_unlock(&arv->trava);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(caminho, O_RDONLY);
+    if (fd < 0) { perror("Snapshot open failed"); pthread_mutex_unlock(&arv->trava); return EXIT_FAILURE; }
+    struct stat st;
+    void *mapa = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(tsnapshot_cab)) {
+        mapa = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapa == MAP_FAILED) { perror("Snapshot mmap failed"); pthread_mutex_unlock(&arv->trava); return EXIT_FAILURE; }
+
+    tsnapshot_cab *cab = mapa;
+    size_t tam = st.st_size;
+    if (!_kdtree_snapshot_valido(arv, mapa, tam)) {
+        fprintf(stderr, "Invalid snapshot: %s\n", caminho);
+        munmap(mapa, tam);
+        pthread_mutex_unlock(&arv->trava);
+        return EXIT_FAILURE;
+    }
+
+    int n = cab->n;
+    tno_plano *nos = (tno_plano *)((char *)mapa + cab->off_nos);
+    treg *regs = (treg *)((char *)mapa + cab->off_regs);
+    tnode *bloco = malloc(sizeof(tnode) * (n > 0 ? n : 1));
+    if (!bloco) { perror("Node alloc failed"); munmap(mapa, tam); pthread_mutex_unlock(&arv->trava); return EXIT_FAILURE; }
+    for (int i = 0; i < n; ++i) {
+        bloco[i].key = &regs[i];
+        bloco[i].esq = nos[i].esq >= 0 ? &bloco[nos[i].esq] : NULL;
+        bloco[i].dir = nos[i].dir >= 0 ? &bloco[nos[i].dir] : NULL;
+        bloco[i].removido = 0;
+        bloco[i].geracao = arv->geracao;
+    }
+
+    arv->mapa = mapa;
+    arv->tam_mapa = tam;
+    arv->bloco = bloco;
+    arv->n_bloco = n;
+    arv->raiz_trabalho = n > 0 ? &bloco[0] : NULL;
+    arv->n_nos = n;
+    arv->n_removidos = 0;
+    arv->altura = cab->altura;
+    arv->indice_pendente = 1;
+    _kdtree_publica(arv);
+    pthread_mutex_unlock(&arv->trava);
+    return EXIT_SUCCESS;
+}
+
+// Reaplica o log sobre a árvore e passa a registrar nele todas as escritas
+int kdtree_abre_log(tarv *arv, const char *caminho) {
+    FILE *f = fopen(caminho, "rb");
+    long valido = 0;
+    if (f) {
+        uint32_t cab[2];
+        treg reg;
+        while (fread(cab, sizeof(cab), 1, f) == 1 && fread(&reg, sizeof(treg), 1, f) == 1) {
+            if (cab[0] == LOG_INSERE) kdtree_insere(arv, aloca_reg(reg.lat, reg.lon, reg.embedding, reg.person_id));
+            else if (cab[0] == LOG_REMOVE) kdtree_remove(arv, reg.person_id);
+            else if (cab[0] == LOG_ESVAZIA) kdtree_esvazia(arv);
+            valido = ftell(f);
+        }
+        fclose(f);
+        // Descarta uma entrada incompleta deixada por uma queda no meio da escrita
+        if (truncate(caminho, valido) != 0) { perror("Log truncate failed"); return EXIT_FAILURE; }
+    }
+
+    FILE *log = fopen(caminho, "ab");
+    if (!log) { perror("Log open failed"); return EXIT_FAILURE; }
+    pthread_mutex_lock(&arv->trava);
+    if (arv->log) fclose(arv->log);
+    arv->log = log;
+    pthread_mutex_unlock(&arv->trava);
+    return EXIT_SUCCESS;
+}
+
+// Para de registrar as escritas; o log fica como está
+void kdtree_fecha_log(tarv *arv) {
+    pthread_mutex_lock(&arv->trava);
+    if (arv->log) fclose(arv->log);
+    arv->log = NULL;
+    pthread_mutex_unlock(&arv->trava);
+}
+
+// --- Leitura ---
 // Busca recursiva por N vizinhos mais próximos, utilizando um max-heap para manter os resultados
-void _kdtree_busca_n_nearest(tarv *arv, tnode *atual, void *key_query, int profund, max_heap *heap_results, int N) {
+void _kdtree_busca_n_nearest(tarv *arv, tnode *atual, void *key_query, int profund, max_heap *heap_results, int N, tmetricas *m) {
     if (!atual) return;
+    m->nos_visitados++;
 
-    double dist_atual = arv->dist(atual->key, key_query);
-    if (heap_results->size < N || dist_atual < heap_results->elements[0].distance) {
-        insert_into_max_heap(heap_results, dist_atual, (treg *)atual->key);
+    // Nós removidos continuam orientando a descida, mas não entram no resultado
+    if (!atual->removido) {
+        double dist_atual = arv->dist(atual->key, key_query);
+        m->distancias++;
+        if (heap_results->size < N || dist_atual < heap_results->elements[0].distance) {
+            insert_into_max_heap(heap_results, dist_atual, (treg *)atual->key);
+            m->operacoes_heap++;
+        }
     }
 
     int pos = profund % arv->k;
@@ -197,7 +1188,7 @@ void _kdtree_busca_n_nearest(tarv *arv, tnode *atual, void *key_query, int profu
     tnode *lado_principal = (comp < 0) ? atual->esq : atual->dir;
     tnode *lado_oposto = (comp < 0) ? atual->dir : atual->esq;
 
-    _kdtree_busca_n_nearest(arv, lado_principal, key_query, profund + 1, heap_results, N);
+    _kdtree_busca_n_nearest(arv, lado_principal, key_query, profund + 1, heap_results, N, m);
 
     double dist_to_hyperplane_sq;
     if (pos == 0) dist_to_hyperplane_sq = (((treg *)key_query)->lat - ((treg *)atual->key)->lat);
@@ -205,7 +1196,7 @@ void _kdtree_busca_n_nearest(tarv *arv, tnode *atual, void *key_query, int profu
     dist_to_hyperplane_sq *= dist_to_hyperplane_sq;
 
     if (heap_results->size < N || dist_to_hyperplane_sq < heap_results->elements[0].distance) {
-        _kdtree_busca_n_nearest(arv, lado_oposto, key_query, profund + 1, heap_results, N);
+        _kdtree_busca_n_nearest(arv, lado_oposto, key_query, profund + 1, heap_results, N, m);
     }
 }
 
@@ -214,11 +1205,58 @@ typedef struct _treg_array {
     int size;
 } treg_array;
 
-// Função pública para buscar N vizinhos mais próximos
-treg_array buscar_n_mais_proximos(tarv *arv, treg query, int n_neighbors) {
+// Versão fixada da árvore: a raiz e os registros alcançáveis por ela continuam
+// válidos, e imutáveis, até kdtree_solta
+typedef struct _versao {
+    tarv *arv;
+    tnode *raiz;
+    int slot;
+} tversao;
+
+tversao kdtree_fixa(tarv *arv) {
+    tversao versao;
+    versao.arv = arv;
+    versao.slot = _kdtree_fixa_epoca(arv);
+    versao.raiz = __atomic_load_n(&arv->raiz, __ATOMIC_SEQ_CST);
+    return versao;
+}
+
+void kdtree_solta(tversao *versao) {
+    _kdtree_solta_epoca(versao->arv, versao->slot);
+    versao->raiz = NULL;
+}
+
+// Soma sem RMW atômico: o leitor dono do slot é o único escritor
+void _kdtree_soma_metrica(uint64_t *total, uint64_t valor) {
+    __atomic_store_n(total, *total + valor, __ATOMIC_RELAXED);
+}
+
+// Busca a partir da raiz da versão e acumula as métricas no slot do leitor
+void _kdtree_busca_medida(tversao *versao, void *key_query, max_heap *heap_results, int N) {
+    tmetricas m = {0};
+    struct timespec inicio, fim;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    _kdtree_busca_n_nearest(versao->arv, versao->raiz, key_query, 0, heap_results, N, &m);
+    clock_gettime(CLOCK_MONOTONIC, &fim);
+    uint64_t ns = (uint64_t)(fim.tv_sec - inicio.tv_sec) * 1000000000ULL + (fim.tv_nsec - inicio.tv_nsec);
+
+    int faixa = 0;
+    for (uint64_t us = ns / 1000; us && faixa < FAIXAS_LATENCIA - 1; us >>= 1) faixa++;
+
+    tmetricas *total = &versao->arv->leitores[versao->slot].metricas;
+    _kdtree_soma_metrica(&total->buscas, 1);
+    _kdtree_soma_metrica(&total->nos_visitados, m.nos_visitados);
+    _kdtree_soma_metrica(&total->distancias, m.distancias);
+    _kdtree_soma_metrica(&total->operacoes_heap, m.operacoes_heap);
+    _kdtree_soma_metrica(&total->tempo_ns, ns);
+    _kdtree_soma_metrica(&total->histograma[faixa], 1);
+}
+
+// Busca os N vizinhos mais próximos numa versão fixada
+treg_array buscar_n_mais_proximos_versao(tversao *versao, treg query, int n_neighbors) {
     max_heap *results_heap = create_max_heap(n_neighbors);
-    
-    _kdtree_busca_n_nearest(arv, arv->raiz, &query, 0, results_heap, n_neighbors);
+
+    _kdtree_busca_medida(versao, &query, results_heap, n_neighbors);
 
     treg_array final_results;
     final_results.size = results_heap->size;
@@ -233,18 +1271,149 @@ treg_array buscar_n_mais_proximos(tarv *arv, treg query, int n_neighbors) {
     for (int i = 0; i < final_results.size; ++i) {
         final_results.elements[i] = *(results_heap->elements[i].data);
     }
-    
+
     destroy_max_heap(results_heap);
     return final_results;
 }
 
+// Função pública para buscar N vizinhos mais próximos na versão mais recente
+treg_array buscar_n_mais_proximos(tarv *arv, treg query, int n_neighbors) {
+    tversao versao = kdtree_fixa(arv);
+    treg_array final_results = buscar_n_mais_proximos_versao(&versao, query, n_neighbors);
+    kdtree_solta(&versao);
+    return final_results;
+}
+
 // Libera memória alocada para o array de resultados
 void free_treg_array(treg_array arr) {
     if (arr.elements) free(arr.elements);
 }
 
+// Resultado de buscar_lote em blocos contíguos de n_consultas × k, em ordem crescente de distância.
+// Os registros não são copiados: regs aponta para os da versão, que fica fixada até
+// libera_resultado_lote. Posições além de tamanhos[q] ficam com distância INFINITY e registro NULL.
+typedef struct _resultado_lote {
+    int n_consultas;
+    int k;
+    int *tamanhos;      // n_consultas
+    double *distancias; // n_consultas × k
+    treg **regs;        // n_consultas × k
+    tversao versao;
+} tresultado_lote;
+
+void libera_resultado_lote(tresultado_lote *r) {
+    if (!r) return;
+    if (r->versao.arv) kdtree_solta(&r->versao);
+    free(r->tamanhos);
+    free(r->distancias);
+    free(r->regs);
+    free(r);
+}
+
+// Copia só um campo (tamanho bytes a partir de deslocamento no treg) de cada vizinho para destino,
+// n_consultas × k itens contíguos; posições vazias ficam zeradas
+int copia_campo_lote(const tresultado_lote *r, size_t deslocamento, size_t tamanho, void *destino) {
+    if (deslocamento > sizeof(treg) || tamanho > sizeof(treg) - deslocamento) return EXIT_FAILURE;
+    char *d = destino;
+    for (size_t i = 0; i < (size_t)r->n_consultas * r->k; ++i, d += tamanho) {
+        if (r->regs[i]) memcpy(d, (char *)r->regs[i] + deslocamento, tamanho);
+        else memset(d, 0, tamanho);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Busca os k vizinhos de cada ponto de coords (n_consultas × 2: lat, lon), todos na mesma versão
+tresultado_lote *buscar_lote(tarv *arv, int n_consultas, const double *coords, int k) {
+    if (k < 1 || n_consultas < 0) return NULL;
+    tresultado_lote *r = malloc(sizeof(tresultado_lote));
+    if (!r) { perror("Results alloc failed"); return NULL; }
+    r->n_consultas = n_consultas;
+    r->k = k;
+    r->versao.arv = NULL;
+    r->tamanhos = malloc(sizeof(int) * (n_consultas > 0 ? n_consultas : 1));
+    r->distancias = malloc(sizeof(double) * ((size_t)n_consultas * k > 0 ? (size_t)n_consultas * k : 1));
+    r->regs = calloc((size_t)n_consultas * k > 0 ? (size_t)n_consultas * k : 1, sizeof(treg *));
+    if (!r->tamanhos || !r->distancias || !r->regs) {
+        perror("Results alloc failed");
+        libera_resultado_lote(r);
+        return NULL;
+    }
+
+    max_heap *heap = create_max_heap(k);
+    treg query = { .person_id = "query" };
+    r->versao = kdtree_fixa(arv);
+    for (int q = 0; q < n_consultas; ++q) {
+        query.lat = coords[2 * q];
+        query.lon = coords[2 * q + 1];
+        heap->size = 0;
+        _kdtree_busca_medida(&r->versao, &query, heap, k);
+
+        size_t base = (size_t)q * k;
+        r->tamanhos[q] = heap->size;
+        for (int j = heap->size; j < k; ++j) r->distancias[base + j] = INFINITY;
+        for (int j = heap->size - 1; j >= 0; --j) {
+            heap_element e = extract_max_from_heap(heap);
+            r->distancias[base + j] = e.distance;
+            r->regs[base + j] = e.data;
+        }
+    }
+    destroy_max_heap(heap);
+    return r;
+}
+
+// Soma as métricas de todos os slots de leitores
+void kdtree_metricas(tarv *arv, tmetricas *out) {
+    memset(out, 0, sizeof(tmetricas));
+    for (int i = 0; i < MAX_LEITORES; ++i) {
+        tmetricas *m = &arv->leitores[i].metricas;
+        out->buscas += __atomic_load_n(&m->buscas, __ATOMIC_RELAXED);
+        out->nos_visitados += __atomic_load_n(&m->nos_visitados, __ATOMIC_RELAXED);
+        out->distancias += __atomic_load_n(&m->distancias, __ATOMIC_RELAXED);
+        out->operacoes_heap += __atomic_load_n(&m->operacoes_heap, __ATOMIC_RELAXED);
+        out->tempo_ns += __atomic_load_n(&m->tempo_ns, __ATOMIC_RELAXED);
+        for (int j = 0; j < FAIXAS_LATENCIA; ++j) out->histograma[j] += __atomic_load_n(&m->histograma[j], __ATOMIC_RELAXED);
+    }
+}
+
+// --- API estável ---
+// Para clientes externos (ctypes) tarv é um handle opaco: só é criado, passado e liberado
+// por estas funções e pelas que recebem tarv *. Apenas os campos iniciais (raiz, cmp, dist, k)
+// têm posição garantida; o restante da estrutura pode mudar entre versões, assim como tnode.
+// treg, treg_array, tversao (devolvida por valor), tresultado_lote e tmetricas são espelhadas
+// pelo cliente: mudar qualquer uma delas exige incrementar KDTREE_ABI_VERSAO.
+int kdtree_abi_versao(void) {
+    return KDTREE_ABI_VERSAO;
+}
+
+// Cria uma árvore de coordenadas (lat, lon)
+tarv *kdtree_cria(void) {
+    // Os slots dos leitores exigem alinhamento de linha de cache, maior que o do malloc
+    tarv *arv = aligned_alloc(_Alignof(tarv), sizeof(tarv));
+    if (!arv) { perror("Tree alloc failed"); return NULL; }
+    kdtree_constroi(arv, comparador, distancia_kdtree_coord, 2);
+    return arv;
+}
+
+void kdtree_libera(tarv *arv) {
+    if (!arv) return;
+    kdtree_destroi(arv);
+    free(arv);
+}
+
+// Copia o registro; person_id com mais de MAX_PERSON_ID_LEN - 1 bytes é truncado
+void kdtree_insere_ponto(tarv *arv, double lat, double lon, const float *embedding, const char *person_id) {
+    kdtree_insere(arv, aloca_reg(lat, lon, (float *)embedding, person_id));
+}
+
+// Pontos vivos na versão publicada; não toma a trava, então não espera reconstruções nem gravações
+int kdtree_tamanho(tarv *arv) {
+    return __atomic_load_n(&arv->vivos, __ATOMIC_RELAXED);
+}
+
 // Árvore global
 tarv arvore_global;
+int arvore_global_construida = 0;
+pthread_mutex_t trava_global = PTHREAD_MUTEX_INITIALIZER;
 
 tarv* get_tree() {
     return &arvore_global;
@@ -255,11 +1424,50 @@ void inserir_ponto(double lat, double lon, float embedding[EMBEDDING_DIM], const
     kdtree_insere(&arvore_global, novo_reg);
 }
 
+int remover_ponto(const char person_id[MAX_PERSON_ID_LEN]) {
+    return kdtree_remove(&arvore_global, person_id);
+}
+
+int atualizar_ponto(double lat, double lon, float embedding[EMBEDDING_DIM], const char person_id[MAX_PERSON_ID_LEN]) {
+    return kdtree_atualiza(&arvore_global, person_id, lat, lon, embedding);
+}
+
+void inserir_pontos_lote(int n, const double *coords, const float *embeddings, const char *ids, int id_stride) {
+    kdtree_insere_lote(&arvore_global, n, coords, embeddings, ids, id_stride);
+}
+
+// A árvore global é construída uma vez; chamadas seguintes só a esvaziam,
+// porque buscas e a reconstrução podem estar usando a árvore atual
 void kdtree_construir() {
-    arvore_global.k = 2;
-    arvore_global.dist = distancia_kdtree_coord;
-    arvore_global.cmp = comparador;
-    arvore_global.raiz = NULL;
+    pthread_mutex_lock(&trava_global);
+    if (arvore_global_construida) kdtree_esvazia(&arvore_global);
+    else kdtree_constroi(&arvore_global, comparador, distancia_kdtree_coord, 2);
+    arvore_global_construida = 1;
+    pthread_mutex_unlock(&trava_global);
+}
+
+// Não pode haver leitores com versão fixada
+void kdtree_destruir() {
+    pthread_mutex_lock(&trava_global);
+    if (arvore_global_construida) kdtree_destroi(&arvore_global);
+    arvore_global_construida = 0;
+    pthread_mutex_unlock(&trava_global);
+}
+
+int salvar_arvore(const char *snapshot) {
+    return kdtree_salva(&arvore_global, snapshot);
+}
+
+// Reinicia a árvore global a partir do último snapshot (se existir) e do log
+int carregar_arvore(const char *snapshot, const char *log) {
+    // O estado vem do disco: esvaziar a árvore atual não deve ir para o log
+    pthread_mutex_lock(&trava_global);
+    if (arvore_global_construida) kdtree_fecha_log(&arvore_global);
+    pthread_mutex_unlock(&trava_global);
+    kdtree_construir();
+    if (snapshot && access(snapshot, F_OK) == 0 && kdtree_carrega(&arvore_global, snapshot) != EXIT_SUCCESS) return EXIT_FAILURE;
+    if (log) return kdtree_abre_log(&arvore_global, log);
+    return EXIT_SUCCESS;
 }
 
 /* Testes */
@@ -284,11 +1492,11 @@ void test_constroi(){
     assert(strcmp(node2_key->person_id, "Campo Grande") == 0);
     free(node1_key);
     free(node2_key);
+    kdtree_destroi(&arv);
 }
 
 void test_busca_n_nearest(){
-    tarv arv;
-    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    kdtree_construir();
 
     float dummy_emb[EMBEDDING_DIM];
     for(int i=0; i<EMBEDDING_DIM; ++i) dummy_emb[i] = (float)i/100.0;
@@ -316,7 +1524,7 @@ void test_busca_n_nearest(){
     };
 
     int n_neighbors = 3;
-    treg_array results = buscar_n_mais_proximos(&arv, query_point, n_neighbors);
+    treg_array results = buscar_n_mais_proximos(get_tree(), query_point, n_neighbors);
 
     printf("Neighbors found for (7,14):\n");
     for (int i = 0; i < results.size; ++i) {
@@ -339,12 +1547,673 @@ void test_busca_n_nearest(){
 
     free_treg_array(results);
 
-    kdtree_destroi(&arvore_global);
+    // Construir de novo só esvazia a árvore global; a versão fixada continua válida
+    tversao fixada = kdtree_fixa(get_tree());
+    kdtree_construir();
+    results = buscar_n_mais_proximos_versao(&fixada, query_point, n_neighbors);
+    assert(results.size == n_neighbors);
+    free_treg_array(results);
+    kdtree_solta(&fixada);
+    results = buscar_n_mais_proximos(get_tree(), query_point, n_neighbors);
+    assert(results.size == 0);
+    free_treg_array(results);
+
+    kdtree_destruir();
+}
+
+void test_remove_atualiza(){
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+
+    float dummy_emb[EMBEDDING_DIM];
+    for(int i=0; i<EMBEDDING_DIM; ++i) dummy_emb[i] = (float)i/100.0;
+
+    kdtree_insere(&arv, aloca_reg(10.0, 10.0, dummy_emb, "a"));
+    kdtree_insere(&arv, aloca_reg(7.0, 15.0, dummy_emb, "e"));
+    kdtree_insere(&arv, aloca_reg(4.0, 11.0, dummy_emb, "f"));
+
+    treg query_point = { .lat = 7.0, .lon = 14.0, .person_id = "query" };
+
+    assert(kdtree_remove(&arv, "e") == EXIT_SUCCESS);
+    assert(kdtree_remove(&arv, "e") == EXIT_FAILURE);
+    assert(kdtree_remove(&arv, "inexistente") == EXIT_FAILURE);
+
+    treg_array results = buscar_n_mais_proximos(&arv, query_point, 3);
+    assert(results.size == 2);
+    for (int i = 0; i < results.size; ++i) assert(strcmp(results.elements[i].person_id, "e") != 0);
+    free_treg_array(results);
+
+    // Move "a" para perto da consulta, mantendo o embedding
+    assert(kdtree_atualiza(&arv, "a", 7.0, 14.5, NULL) == EXIT_SUCCESS);
+    assert(kdtree_atualiza(&arv, "e", 0.0, 0.0, NULL) == EXIT_FAILURE);
+    results = buscar_n_mais_proximos(&arv, query_point, 1);
+    assert(results.size == 1);
+    assert(strcmp(results.elements[0].person_id, "a") == 0);
+    assert(results.elements[0].lat == 7.0 && results.elements[0].lon == 14.5);
+    assert(results.elements[0].embedding[5] == dummy_emb[5]);
+    free_treg_array(results);
+
+    // Reinserir um person_id existente substitui o ponto anterior
+    kdtree_insere(&arv, aloca_reg(100.0, 100.0, dummy_emb, "f"));
+    results = buscar_n_mais_proximos(&arv, query_point, 5);
+    assert(results.size == 2);
+    free_treg_array(results);
+
+    kdtree_destroi(&arv);
 }
 
-int main(void){
+void test_reconstrucao(){
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+
+    float dummy_emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    int total = 2000;
+
+    // Inserção ordenada degenera a árvore numa lista e deve disparar a reconstrução
+    for (int i = 0; i < total; ++i) {
+        sprintf(id, "p%d", i);
+        kdtree_insere(&arv, aloca_reg(i, i, dummy_emb, id));
+    }
+    kdtree_aguarda_reconstrucao(&arv);
+    assert(arv.altura <= FATOR_DESBALANCO * log2(arv.n_nos - arv.n_removidos + 1));
+
+    // Remover a maioria dos pontos deve disparar a reconstrução por tombstones
+    for (int i = 0; i < total; i += 4) {
+        for (int j = 0; j < 3; ++j) {
+            sprintf(id, "p%d", i + j);
+            assert(kdtree_remove(&arv, id) == EXIT_SUCCESS);
+        }
+    }
+    assert(kdtree_tamanho(&arv) == total / 4); // Lido enquanto a reconstrução pode estar rodando
+    kdtree_aguarda_reconstrucao(&arv);
+    assert(arv.n_removidos <= LIMIAR_REMOVIDOS * arv.n_nos);
+
+    treg query_point = { .lat = 1000.0, .lon = 1000.0, .person_id = "query" };
+    treg_array results = buscar_n_mais_proximos(&arv, query_point, 2);
+    assert(results.size == 2);
+    for (int i = 0; i < results.size; ++i) {
+        assert(strcmp(results.elements[i].person_id, "p999") == 0 || strcmp(results.elements[i].person_id, "p1003") == 0);
+    }
+    free_treg_array(results);
+
+    sprintf(id, "p%d", 3);
+    assert(kdtree_atualiza(&arv, id, 1000.0, 1000.0, NULL) == EXIT_SUCCESS);
+    results = buscar_n_mais_proximos(&arv, query_point, 1);
+    assert(strcmp(results.elements[0].person_id, "p3") == 0);
+    free_treg_array(results);
+
+    kdtree_destroi(&arv);
+}
+
+void _test_conta_vivos(tnode *node, int *vivos, int *removidos) {
+    if (!node) return;
+    if (node->removido) (*removidos)++;
+    else (*vivos)++;
+    _test_conta_vivos(node->esq, vivos, removidos);
+    _test_conta_vivos(node->dir, vivos, removidos);
+}
+
+void test_insercao_ordenada(){
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+
+    float dummy_emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    int total = 20000;
+
+    // Inserção ordenada só reconstrói subárvores: o trabalho total fica em O(n log n)
+    for (int i = 0; i < total; ++i) {
+        sprintf(id, "o%d", i);
+        kdtree_insere(&arv, aloca_reg(i, i, dummy_emb, id));
+        if (i % 3 == 0 && i > 0) {
+            sprintf(id, "o%d", i - 1);
+            assert(kdtree_remove(&arv, id) == EXIT_SUCCESS);
+        }
+    }
+    kdtree_aguarda_reconstrucao(&arv);
+    assert(arv.nos_reconstruidos <= 2 * total * log2(total));
+    assert(arv.altura <= FATOR_DESBALANCO * log2(arv.n_nos + 1) + 1);
+
+    // Os contadores acompanham os removidos descartados junto com as subárvores
+    int vivos = 0, removidos = 0;
+    _test_conta_vivos(arv.raiz, &vivos, &removidos);
+    assert(vivos == arv.n_nos - arv.n_removidos && removidos == arv.n_removidos);
+    assert(vivos == total - (total - 1) / 3);
+
+    for (int i = 0; i < total; i += 997) {
+        treg query_point = { .lat = i, .lon = i, .person_id = "query" };
+        treg_array results = buscar_n_mais_proximos(&arv, query_point, 1);
+        sprintf(id, "o%d", i);
+        int removido = i % 3 == 2 && i + 1 < total;
+        assert(results.size == 1 && (removido || strcmp(results.elements[0].person_id, id) == 0));
+        free_treg_array(results);
+    }
+
+    kdtree_destroi(&arv);
+}
+
+void test_rotatividade(){
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+
+    float dummy_emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    int vivos = 50, passos = 20000;
+
+    // Cada passo insere um id novo e remove o mais antigo: o índice acumula marcas de removido
+    for (int i = 0; i < vivos; ++i) {
+        sprintf(id, "r%d", i);
+        kdtree_insere(&arv, aloca_reg(i % 97, i % 89, dummy_emb, id));
+    }
+    for (int i = 0; i < passos; ++i) {
+        sprintf(id, "r%d", vivos + i);
+        kdtree_insere(&arv, aloca_reg((vivos + i) % 97, (vivos + i) % 89, dummy_emb, id));
+        sprintf(id, "r%d", i);
+        assert(kdtree_remove(&arv, id) == EXIT_SUCCESS);
+        pthread_mutex_lock(&arv.trava); // A reconstrução refaz o índice com a trava
+        assert((float)(arv.indice.size + arv.indice.n_deleted) / (arv.indice.max - 1) < INDICE_LOAD_FACTOR_THRESHOLD);
+        pthread_mutex_unlock(&arv.trava);
+    }
+    kdtree_aguarda_reconstrucao(&arv);
+    assert(arv.indice.size == vivos);
+    assert(arv.indice.max <= 2 * INDICE_BUCKETS_INICIAIS + 1);
+
+    sprintf(id, "r%d", passos);
+    assert(hash_busca(arv.indice, id) != NULL);
+    sprintf(id, "r%d", passos - 1);
+    assert(hash_busca(arv.indice, id) == NULL);
+
+    kdtree_destroi(&arv);
+}
+
+void test_versoes(){
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+
+    float dummy_emb[EMBEDDING_DIM] = {0.0};
+    kdtree_insere(&arv, aloca_reg(10.0, 10.0, dummy_emb, "a"));
+    kdtree_insere(&arv, aloca_reg(4.0, 11.0, dummy_emb, "f"));
+
+    treg query_point = { .lat = 7.0, .lon = 14.0, .person_id = "query" };
+
+    // Escritas depois de fixar a versão não aparecem nela
+    tversao antiga = kdtree_fixa(&arv);
+    kdtree_insere(&arv, aloca_reg(7.0, 15.0, dummy_emb, "e"));
+    assert(kdtree_remove(&arv, "a") == EXIT_SUCCESS);
+    assert(kdtree_atualiza(&arv, "f", 50.0, 50.0, NULL) == EXIT_SUCCESS);
+
+    treg_array results = buscar_n_mais_proximos_versao(&antiga, query_point, 5);
+    assert(results.size == 2);
+    for (int i = 0; i < results.size; ++i) {
+        assert(strcmp(results.elements[i].person_id, "e") != 0);
+        if (strcmp(results.elements[i].person_id, "f") == 0) assert(results.elements[i].lat == 4.0);
+    }
+    free_treg_array(results);
+    kdtree_solta(&antiga);
+    assert(arv.aposentados != NULL);
+
+    results = buscar_n_mais_proximos(&arv, query_point, 5);
+    assert(results.size == 2);
+    assert(strcmp(results.elements[0].person_id, "f") == 0 || strcmp(results.elements[1].person_id, "f") == 0);
+    assert(strcmp(results.elements[0].person_id, "e") == 0 || strcmp(results.elements[1].person_id, "e") == 0);
+    free_treg_array(results);
+
+    // Sem leitores fixados, a próxima escrita libera o que foi aposentado
+    kdtree_insere(&arv, aloca_reg(1.0, 1.0, dummy_emb, "g"));
+    assert(arv.aposentados == NULL);
+
+    // Esvaziar a árvore não invalida a versão fixada antes
+    antiga = kdtree_fixa(&arv);
+    kdtree_esvazia(&arv);
+    results = buscar_n_mais_proximos_versao(&antiga, query_point, 5);
+    assert(results.size == 3);
+    free_treg_array(results);
+    kdtree_solta(&antiga);
+
+    results = buscar_n_mais_proximos(&arv, query_point, 5);
+    assert(results.size == 0);
+    free_treg_array(results);
+    kdtree_insere(&arv, aloca_reg(7.0, 15.0, dummy_emb, "e"));
+    assert(kdtree_remove(&arv, "g") == EXIT_FAILURE);
+    results = buscar_n_mais_proximos(&arv, query_point, 5);
+    assert(results.size == 1 && strcmp(results.elements[0].person_id, "e") == 0);
+    free_treg_array(results);
+
+    kdtree_destroi(&arv);
+}
+
+void test_persistencia(){
+    const char *snap = "test_kdtree.snap";
+    const char *log = "test_kdtree.log";
+    remove(snap);
+    remove(log);
+
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    assert(kdtree_abre_log(&arv, log) == EXIT_SUCCESS);
+
+    float emb[EMBEDDING_DIM];
+    for(int i=0; i<EMBEDDING_DIM; ++i) emb[i] = (float)i/100.0;
+    char id[MAX_PERSON_ID_LEN];
+    for (int i = 0; i < 200; ++i) {
+        sprintf(id, "p%d", i);
+        kdtree_insere(&arv, aloca_reg(i, 200 - i, emb, id));
+    }
+    assert(kdtree_remove(&arv, "p0") == EXIT_SUCCESS);
+    assert(kdtree_salva(&arv, snap) == EXIT_SUCCESS);
+
+    // Escritas depois do snapshot ficam só no log
+    kdtree_insere(&arv, aloca_reg(500.0, 500.0, emb, "novo"));
+    assert(kdtree_remove(&arv, "p1") == EXIT_SUCCESS);
+    assert(kdtree_atualiza(&arv, "p2", 499.0, 499.0, NULL) == EXIT_SUCCESS);
+    kdtree_destroi(&arv);
+
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    assert(kdtree_carrega(&arv, snap) == EXIT_SUCCESS);
+    assert(arv.n_nos == 199);
+
+    // Consulta direto sobre o snapshot mapeado, antes de reaplicar o log
+    treg query_point = { .lat = 0.0, .lon = 200.0, .person_id = "query" };
+    treg_array results = buscar_n_mais_proximos(&arv, query_point, 1);
+    assert(results.size == 1 && strcmp(results.elements[0].person_id, "p1") == 0);
+    assert(results.elements[0].embedding[7] == emb[7]);
+    free_treg_array(results);
+
+    assert(kdtree_abre_log(&arv, log) == EXIT_SUCCESS);
+    results = buscar_n_mais_proximos(&arv, query_point, 1);
+    assert(results.size == 1 && strcmp(results.elements[0].person_id, "p3") == 0);
+    free_treg_array(results);
+
+    treg longe = { .lat = 500.0, .lon = 500.0, .person_id = "query" };
+    results = buscar_n_mais_proximos(&arv, longe, 2);
+    assert(results.size == 2);
+    assert(strcmp(results.elements[0].person_id, "novo") == 0 || strcmp(results.elements[1].person_id, "novo") == 0);
+    assert(strcmp(results.elements[0].person_id, "p2") == 0 || strcmp(results.elements[1].person_id, "p2") == 0);
+    free_treg_array(results);
+
+    // Remover registros do snapshot deve disparar a reconstrução sem liberar memória mapeada
+    for (int i = 3; i < 150; ++i) {
+        sprintf(id, "p%d", i);
+        assert(kdtree_remove(&arv, id) == EXIT_SUCCESS);
+    }
+    kdtree_aguarda_reconstrucao(&arv);
+    assert(arv.n_removidos <= LIMIAR_REMOVIDOS * arv.n_nos);
+    kdtree_destroi(&arv);
+
+    // Esvaziar com o log aberto descarta o snapshot e o log anterior ao reiniciar
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    assert(kdtree_carrega(&arv, snap) == EXIT_SUCCESS);
+    tversao fixada = kdtree_fixa(&arv);
+    assert(kdtree_abre_log(&arv, log) == EXIT_SUCCESS); // As remoções do log reconstroem a árvore
+    kdtree_aguarda_reconstrucao(&arv);
+    kdtree_esvazia(&arv);
+    assert(arv.mapa == NULL && arv.bloco == NULL);
+    results = buscar_n_mais_proximos_versao(&fixada, longe, 2);
+    assert(results.size == 2);
+    free_treg_array(results);
+    kdtree_solta(&fixada);
+    kdtree_insere(&arv, aloca_reg(3.0, 3.0, emb, "depois"));
+    kdtree_destroi(&arv);
+
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    assert(kdtree_carrega(&arv, snap) == EXIT_SUCCESS);
+    assert(kdtree_abre_log(&arv, log) == EXIT_SUCCESS);
+    assert(arv.n_nos - arv.n_removidos == 1);
+    results = buscar_n_mais_proximos(&arv, longe, 5);
+    assert(results.size == 1 && strcmp(results.elements[0].person_id, "depois") == 0);
+    free_treg_array(results);
+    kdtree_destroi(&arv);
+
+    // Lote sobre o snapshot mapeado: os registros substituídos não são liberados com free
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    assert(kdtree_carrega(&arv, snap) == EXIT_SUCCESS);
+    double *coords = malloc(sizeof(double) * 2 * 200);
+    float *embs = calloc(200, sizeof(float) * EMBEDDING_DIM);
+    char *ids = calloc(200, 16);
+    for (int i = 0; i < 200; ++i) {
+        coords[2 * i] = -i;
+        coords[2 * i + 1] = -i;
+        sprintf(ids + i * 16, "p%d", i);
+    }
+    kdtree_insere_lote(&arv, 200, coords, embs, ids, 16);
+    assert(arv.n_nos == 200);
+    results = buscar_n_mais_proximos(&arv, query_point, 1);
+    assert(results.size == 1 && results.elements[0].lat <= 0.0);
+    free_treg_array(results);
+    kdtree_destroi(&arv);
+    free(coords);
+    free(embs);
+    free(ids);
+
+    // Carregar o snapshot numa árvore com pontos é recusado
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    kdtree_insere(&arv, aloca_reg(1.0, 1.0, emb, "x"));
+    assert(kdtree_carrega(&arv, snap) == EXIT_FAILURE);
+    kdtree_destroi(&arv);
+
+    // Snapshots corrompidos são recusados
+    FILE *f = fopen(snap, "rb");
+    fseek(f, 0, SEEK_END);
+    long tam = ftell(f);
+    rewind(f);
+    char *original = malloc(tam), *copia = malloc(tam);
+    assert(fread(original, 1, tam, f) == (size_t)tam);
+    fclose(f);
+    tsnapshot_cab *cab = (tsnapshot_cab *)copia;
+    for (int caso = 0; caso < 6; ++caso) {
+        memcpy(copia, original, tam);
+        tno_plano *nos = (tno_plano *)(copia + cab->off_nos);
+        treg *regs = (treg *)(copia + cab->off_regs);
+        if (caso == 0) nos[1].esq = 0;                 // Ciclo
+        else if (caso == 1) nos[0].dir = nos[0].esq;   // Filho com dois pais
+        else if (caso == 2) nos[0].esq = -2;
+        else if (caso == 3) memset(regs[0].person_id, 'x', MAX_PERSON_ID_LEN);
+        else if (caso == 4) cab->off_regs += 4;
+        else regs[5].lat = NAN;
+        f = fopen(snap, "wb");
+        assert(fwrite(copia, 1, tam, f) == (size_t)tam);
+        fclose(f);
+        kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+        assert(kdtree_carrega(&arv, snap) == EXIT_FAILURE);
+        kdtree_destroi(&arv);
+    }
+    free(original);
+    free(copia);
+
+    remove(snap);
+    remove(log);
+}
+
+void test_lote(){
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+
+    int n = 300;
+    double *coords = malloc(sizeof(double) * 2 * n);
+    float *embeddings = malloc(sizeof(float) * EMBEDDING_DIM * n);
+    char *ids = calloc(n, 8);
+    for (int i = 0; i < n; ++i) {
+        coords[2 * i] = i % 17;
+        coords[2 * i + 1] = i / 17;
+        for (int j = 0; j < EMBEDDING_DIM; ++j) embeddings[i * EMBEDDING_DIM + j] = i;
+        char id[16];
+        sprintf(id, "lote%04d", i); // 8 bytes: ocupa o campo inteiro, sem '\0'
+        memcpy(ids + i * 8, id, 8);
+    }
+    kdtree_insere_lote(&arv, n, coords, embeddings, ids, 8);
+    assert(arv.n_nos == n);
+
+    double consultas[] = { 3.2, 4.1, 16.0, 17.0, -5.0, -5.0 };
+    int k = 5;
+    tresultado_lote *r = buscar_lote(&arv, 3, consultas, k);
+    assert(r && r->n_consultas == 3 && r->k == k);
+    for (int q = 0; q < 3; ++q) {
+        assert(r->tamanhos[q] == k);
+        treg query_point = { .lat = consultas[2 * q], .lon = consultas[2 * q + 1], .person_id = "query" };
+        treg_array esperado = buscar_n_mais_proximos(&arv, query_point, k);
+        double pior = 0.0;
+        for (int i = 0; i < esperado.size; ++i) {
+            double d = distancia_kdtree_coord(&esperado.elements[i], &query_point);
+            if (d > pior) pior = d;
+        }
+        for (int j = 0; j < k; ++j) {
+            treg *reg = r->regs[q * k + j];
+            assert(r->distancias[q * k + j] == distancia_kdtree_coord(reg, &query_point));
+            if (j > 0) assert(r->distancias[q * k + j - 1] <= r->distancias[q * k + j]);
+            assert(strlen(reg->person_id) == 8 && strncmp(reg->person_id, "lote", 4) == 0);
+            assert(reg->embedding[0] == atoi(reg->person_id + 4));
+        }
+        assert(r->distancias[q * k + k - 1] == pior);
+        free_treg_array(esperado);
+    }
+    libera_resultado_lote(r);
+
+    // Lote maior que a árvore: é montada uma árvore balanceada nova. Os 100 primeiros ids
+    // já existem e são movidos; os demais se repetem e vale o último
+    int n2 = 400;
+    double *coords2 = malloc(sizeof(double) * 2 * n2);
+    float *embeddings2 = calloc(n2, sizeof(float) * EMBEDDING_DIM);
+    char *ids2 = calloc(n2, 16);
+    for (int i = 0; i < n2; ++i) {
+        coords2[2 * i] = i < 100 ? 1000 + i : 2000 + i;
+        coords2[2 * i + 1] = i < 100 ? 1000 : 2000;
+        if (i < 100) sprintf(ids2 + i * 16, "lote%04d", i);
+        else sprintf(ids2 + i * 16, "novo%d", i % 200);
+    }
+    tversao antes = kdtree_fixa(&arv);
+    kdtree_insere_lote(&arv, n2, coords2, embeddings2, ids2, 16);
+    assert(arv.n_nos == n + 200 && arv.n_removidos == 0);
+    assert(arv.altura <= ceil(log2(arv.n_nos + 1)));
+    treg perto = { .lat = 1005.0, .lon = 1000.0, .person_id = "query" };
+    treg_array achados = buscar_n_mais_proximos_versao(&antes, perto, 1); // A versão fixada não muda
+    assert(achados.size == 1 && achados.elements[0].lat <= 16.0);
+    free_treg_array(achados);
+    kdtree_solta(&antes);
+    achados = buscar_n_mais_proximos(&arv, perto, 1);
+    assert(achados.size == 1 && strcmp(achados.elements[0].person_id, "lote0005") == 0);
+    free_treg_array(achados);
+    perto.lat = 2105.0;
+    perto.lon = 2000.0;
+    achados = buscar_n_mais_proximos(&arv, perto, 1);
+    assert(achados.size == 1 && achados.elements[0].lat == 2200.0);
+    free_treg_array(achados);
+    assert(kdtree_remove(&arv, "lote0005") == EXIT_SUCCESS);
+    assert(kdtree_remove(&arv, "novo105") == EXIT_SUCCESS);
+    free(coords2);
+    free(embeddings2);
+    free(ids2);
+
+    // Menos pontos que k: o restante fica vazio
+    tarv pequena;
+    kdtree_constroi(&pequena,comparador,distancia_kdtree_coord,2);
+    kdtree_insere_lote(&pequena, 2, coords, embeddings, ids, 8);
+    r = buscar_lote(&pequena, 1, consultas, 4);
+    assert(r->tamanhos[0] == 2);
+    assert(isinf(r->distancias[2]) && isinf(r->distancias[3]));
+    assert(r->regs[2] == NULL && r->regs[3] == NULL);
+
+    // Os registros apontados continuam válidos enquanto o resultado existir, mesmo depois de esvaziar a árvore
+    kdtree_esvazia(&pequena);
+    kdtree_insere_lote(&pequena, 2, coords, embeddings, ids, 8);
+    assert(strncmp(r->regs[0]->person_id, "lote", 4) == 0);
+    double lats[4];
+    char nomes[4][MAX_PERSON_ID_LEN];
+    assert(copia_campo_lote(r, offsetof(treg, lat), sizeof(double), lats) == EXIT_SUCCESS);
+    assert(copia_campo_lote(r, offsetof(treg, person_id), MAX_PERSON_ID_LEN, nomes) == EXIT_SUCCESS);
+    for (int j = 0; j < 2; ++j) {
+        assert(lats[j] == r->regs[j]->lat && strcmp(nomes[j], r->regs[j]->person_id) == 0);
+    }
+    assert(lats[2] == 0.0 && nomes[3][0] == '\0');
+    assert(copia_campo_lote(r, sizeof(treg) - 4, 8, lats) == EXIT_FAILURE);
+    libera_resultado_lote(r);
+    assert(buscar_lote(&pequena, 1, consultas, 0) == NULL);
+    kdtree_destroi(&pequena);
+
+    free(coords);
+    free(embeddings);
+    free(ids);
+    kdtree_destroi(&arv);
+}
+
+void test_metricas(){
+    tarv *arv = kdtree_cria();
+    assert((uintptr_t)arv % _Alignof(tarv) == 0);
+    assert(arv && arv->k == 2);
+    assert(kdtree_abi_versao() == KDTREE_ABI_VERSAO);
+
+    float emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    for (int i = 0; i < 100; ++i) {
+        sprintf(id, "m%d", i);
+        kdtree_insere_ponto(arv, i, i, emb, id);
+    }
+    assert(kdtree_remove(arv, "m0") == EXIT_SUCCESS);
+    assert(kdtree_tamanho(arv) == 99);
+    pthread_mutex_lock(&arv->trava); // Escritor ocupado: o tamanho não pode esperar pela trava
+    assert(kdtree_tamanho(arv) == 99);
+    pthread_mutex_unlock(&arv->trava);
+
+    tmetricas m;
+    kdtree_metricas(arv, &m);
+    assert(m.buscas == 0 && m.nos_visitados == 0);
+
+    treg query_point = { .lat = 50.0, .lon = 50.0, .person_id = "query" };
+    free_treg_array(buscar_n_mais_proximos(arv, query_point, 3));
+    double consultas[] = { 0.0, 0.0, 99.0, 99.0 };
+    libera_resultado_lote(buscar_lote(arv, 2, consultas, 5));
+
+    kdtree_metricas(arv, &m);
+    assert(m.buscas == 3);
+    assert(m.nos_visitados >= m.distancias && m.distancias >= m.operacoes_heap);
+    assert(m.operacoes_heap >= 3 + 5 + 5);
+    assert(m.nos_visitados < 3 * 100); // A poda evita visitar a árvore inteira
+    uint64_t soma = 0;
+    for (int i = 0; i < FAIXAS_LATENCIA; ++i) soma += m.histograma[i];
+    assert(soma == m.buscas);
+
+    kdtree_esvazia(arv);
+    assert(kdtree_tamanho(arv) == 0);
+    kdtree_libera(arv);
+}
+
+/* Benchmark: buscas concorrentes enquanto um escritor insere */
+typedef struct {
+    tarv *arv;
+    int *parar;
+    long ops;
+    unsigned int semente;
+} targ_bench;
+
+void *_bench_leitor(void *arg) {
+    targ_bench *a = arg;
+    treg query_point = { .person_id = "query" };
+    while (!__atomic_load_n(a->parar, __ATOMIC_RELAXED)) {
+        query_point.lat = rand_r(&a->semente) % 10000 / 100.0;
+        query_point.lon = rand_r(&a->semente) % 10000 / 100.0;
+        treg_array results = buscar_n_mais_proximos(a->arv, query_point, 10);
+        free_treg_array(results);
+        a->ops++;
+    }
+    return NULL;
+}
+
+void *_bench_escritor(void *arg) {
+    targ_bench *a = arg;
+    float emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    while (!__atomic_load_n(a->parar, __ATOMIC_RELAXED)) {
+        sprintf(id, "w%u-%ld", a->semente, a->ops);
+        kdtree_insere(a->arv, aloca_reg(rand_r(&a->semente) % 10000 / 100.0, rand_r(&a->semente) % 10000 / 100.0, emb, id));
+        a->ops++;
+    }
+    return NULL;
+}
+
+double _bench_agora() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void benchmark_leitura_concorrente() {
+    printf("\n--- Benchmark: buscas concorrentes durante insercoes ---\n");
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    float emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    unsigned int semente = 42;
+    for (int i = 0; i < 100000; ++i) {
+        sprintf(id, "p%d", i);
+        kdtree_insere(&arv, aloca_reg(rand_r(&semente) % 10000 / 100.0, rand_r(&semente) % 10000 / 100.0, emb, id));
+    }
+
+    int n_leitores[] = {1, 2, 4, 8};
+    for (int t = 0; t < 4; ++t) {
+        int parar = 0;
+        pthread_t threads[8], escritor;
+        targ_bench args[8], arg_escritor = { &arv, &parar, 0, 1000 + t };
+        for (int i = 0; i < n_leitores[t]; ++i) {
+            args[i] = (targ_bench){ &arv, &parar, 0, i + 1 };
+            pthread_create(&threads[i], NULL, _bench_leitor, &args[i]);
+        }
+        pthread_create(&escritor, NULL, _bench_escritor, &arg_escritor);
+
+        double inicio = _bench_agora();
+        struct timespec espera = { 0, 300000000 };
+        nanosleep(&espera, NULL);
+        __atomic_store_n(&parar, 1, __ATOMIC_RELAXED);
+
+        long buscas = 0;
+        for (int i = 0; i < n_leitores[t]; ++i) {
+            pthread_join(threads[i], NULL);
+            buscas += args[i].ops;
+        }
+        pthread_join(escritor, NULL);
+        double tempo = _bench_agora() - inicio;
+        printf("Leitores: %d | Buscas/s: %.0f | Insercoes/s: %.0f\n", n_leitores[t], buscas / tempo, arg_escritor.ops / tempo);
+    }
+    kdtree_destroi(&arv);
+}
+
+void benchmark_reinicio() {
+    printf("\n--- Benchmark: tempo do reinicio ate a primeira busca ---\n");
+    const char *snap = "bench_kdtree.snap";
+    const char *log = "bench_kdtree.log";
+    int total = 200000;
+    remove(snap);
+    remove(log);
+
+    tarv arv;
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    kdtree_abre_log(&arv, log);
+    float emb[EMBEDDING_DIM] = {0.0};
+    char id[MAX_PERSON_ID_LEN];
+    unsigned int semente = 7;
+    for (int i = 0; i < total; ++i) {
+        sprintf(id, "p%d", i);
+        kdtree_insere(&arv, aloca_reg(rand_r(&semente) % 10000 / 100.0, rand_r(&semente) % 10000 / 100.0, emb, id));
+    }
+    kdtree_destroi(&arv);
+
+    treg query_point = { .lat = 50.0, .lon = 50.0, .person_id = "query" };
+
+    double inicio = _bench_agora();
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    kdtree_abre_log(&arv, log);
+    free_treg_array(buscar_n_mais_proximos(&arv, query_point, 10));
+    printf("Reaplicando o log (%d insercoes): %.3f s\n", total, _bench_agora() - inicio);
+    kdtree_salva(&arv, snap);
+    kdtree_destroi(&arv);
+
+    inicio = _bench_agora();
+    kdtree_constroi(&arv,comparador,distancia_kdtree_coord,2);
+    kdtree_carrega(&arv, snap);
+    kdtree_abre_log(&arv, log);
+    free_treg_array(buscar_n_mais_proximos(&arv, query_point, 10));
+    printf("Carregando o snapshot (%d pontos): %.3f s\n", total, _bench_agora() - inicio);
+    kdtree_destroi(&arv);
+
+    remove(snap);
+    remove(log);
+}
+
+// ./kdtree roda os testes; ./kdtree --bench roda também os benchmarks, que gravam arquivos no diretório atual
+int main(int argc, char **argv){
     test_constroi();
     test_busca_n_nearest();
+    test_remove_atualiza();
+    test_reconstrucao();
+    test_insercao_ordenada();
+    test_rotatividade();
+    test_versoes();
+    test_persistencia();
+    test_lote();
+    test_metricas();
     printf("All tests passed successfully!\n");
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        benchmark_leitura_concorrente();
+        benchmark_reinicio();
+    }
     return EXIT_SUCCESS;
 }
@@ -1,8 +1,11 @@
 import ctypes
-from ctypes import Structure, POINTER, c_double, c_int, c_char, c_float, CFUNCTYPE
+from ctypes import Structure, POINTER, c_double, c_int, c_char, c_float, c_void_p, CFUNCTYPE
+import numpy as np
 
 EMBEDDING_DIM = 128
 MAX_PERSON_ID_LEN = 100
+FAIXAS_LATENCIA = 17  # latency histogram buckets: bucket i counts searches under 2**i microseconds
+KDTREE_ABI_VERSAO = 2
 
 # C-compatible structure for a point (register)
 class TReg(Structure):
@@ -11,26 +14,56 @@ class TReg(Structure):
                 ("embedding", c_float * EMBEDDING_DIM),
                 ("person_id", c_char * MAX_PERSON_ID_LEN)]
 
-# C-compatible structure for a KD-Tree node
-class TNode(Structure):
-    pass # Defined later to handle self-reference
+# NumPy dtype with the same layout as TReg, used to view C-owned records without copying
+TREG_DTYPE = np.dtype([("lat", np.float64),
+                       ("lon", np.float64),
+                       ("embedding", np.float32, (EMBEDDING_DIM,)),
+                       ("person_id", f"S{MAX_PERSON_ID_LEN}")], align=True)
+assert TREG_DTYPE.itemsize == ctypes.sizeof(TReg)
 
-TNode._fields_ = [("key", ctypes.c_void_p),
-                  ("esq", POINTER(TNode)),
-                  ("dir", POINTER(TNode))]
+# KD-Tree node: opaque, its layout is private to kdtree.c and only ever seen through POINTER(TNode)
+class TNode(Structure):
+    pass
 
-# C-compatible structure for the KD-Tree
+# Leading fields of the C tarv, in kdtree.c order. The rest of the struct is private:
+# a tree is an opaque handle, only ever used through POINTER(Tarv)
 class Tarv(Structure):
-    _fields_ = [("k", c_int),
-                ("dist", CFUNCTYPE(c_double, ctypes.c_void_p, ctypes.c_void_p)),
+    _fields_ = [("raiz", POINTER(TNode)),
                 ("cmp", CFUNCTYPE(c_int, ctypes.c_void_p, ctypes.c_void_p, c_int)),
-                ("raiz", POINTER(TNode))]
+                ("dist", CFUNCTYPE(c_double, ctypes.c_void_p, ctypes.c_void_p)),
+                ("k", c_int)]
 
 # C-compatible structure for returning an array of TReg from C
 class TRegArray(Structure):
     _fields_ = [("elements", POINTER(TReg)),
                 ("size", c_int)]
 
+# Pinned snapshot of the tree (see kdtree_fixa / kdtree_solta). kdtree_fixa returns it by value,
+# so this layout is part of the versioned ABI (KDTREE_ABI_VERSAO)
+class TVersao(Structure):
+    _fields_ = [("arv", POINTER(Tarv)),
+                ("raiz", POINTER(TNode)),
+                ("slot", c_int)]
+
+# C-compatible structure for batch search results (n_consultas x k blocks). regs points to
+# the tree's own records, kept alive by the pinned versao until libera_resultado_lote
+class TResultadoLote(Structure):
+    _fields_ = [("n_consultas", c_int),
+                ("k", c_int),
+                ("tamanhos", POINTER(c_int)),
+                ("distancias", POINTER(c_double)),
+                ("regs", POINTER(c_void_p)),
+                ("versao", TVersao)]
+
+# Search metrics summed over all readers (see kdtree_metricas)
+class TMetricas(Structure):
+    _fields_ = [("buscas", ctypes.c_uint64),
+                ("nos_visitados", ctypes.c_uint64),
+                ("distancias", ctypes.c_uint64),
+                ("operacoes_heap", ctypes.c_uint64),
+                ("tempo_ns", ctypes.c_uint64),
+                ("histograma", ctypes.c_uint64 * FAIXAS_LATENCIA)]
+
 # Load the C shared library
 try:
     lib = ctypes.CDLL("./libkdtree.so")
@@ -39,8 +72,41 @@ except OSError as e:
     # This pass allows the Python app to start, but C-dependent calls will fail
     lib = None 
 
+# Refuse a library built with a different handle API, or one too old to report it
+if lib and not hasattr(lib, "kdtree_abi_versao"):
+    print("libkdtree.so does not export kdtree_abi_versao")
+    lib = None
+if lib:
+    lib.kdtree_abi_versao.argtypes = []
+    lib.kdtree_abi_versao.restype = c_int
+    if lib.kdtree_abi_versao() != KDTREE_ABI_VERSAO:
+        print(f"libkdtree.so ABI version {lib.kdtree_abi_versao()} != {KDTREE_ABI_VERSAO}")
+        lib = None
+
 # Define C function signatures
 if lib:
+    # Stable handle API
+    lib.kdtree_cria.argtypes = []
+    lib.kdtree_cria.restype = POINTER(Tarv)
+
+    lib.kdtree_libera.argtypes = [POINTER(Tarv)]
+    lib.kdtree_libera.restype = None
+
+    lib.kdtree_insere_ponto.argtypes = [POINTER(Tarv), c_double, c_double, c_void_p, ctypes.c_char_p]
+    lib.kdtree_insere_ponto.restype = None
+
+    lib.kdtree_remove.argtypes = [POINTER(Tarv), ctypes.c_char_p]
+    lib.kdtree_remove.restype = c_int
+
+    lib.kdtree_atualiza.argtypes = [POINTER(Tarv), ctypes.c_char_p, c_double, c_double, c_void_p]
+    lib.kdtree_atualiza.restype = c_int
+
+    lib.kdtree_tamanho.argtypes = [POINTER(Tarv)]
+    lib.kdtree_tamanho.restype = c_int
+
+    lib.kdtree_metricas.argtypes = [POINTER(Tarv), POINTER(TMetricas)]
+    lib.kdtree_metricas.restype = None
+
     lib.inserir_ponto.argtypes = [c_double, c_double, c_float * EMBEDDING_DIM, c_char * MAX_PERSON_ID_LEN]
     lib.inserir_ponto.restype = None
 
@@ -51,5 +117,175 @@ if lib:
     lib.kdtree_construir.argtypes = []
     lib.kdtree_construir.restype = None
 
+    # Readers pin a snapshot; results stay consistent while writers keep inserting
+    lib.kdtree_fixa.argtypes = [POINTER(Tarv)]
+    lib.kdtree_fixa.restype = TVersao
+
+    lib.kdtree_solta.argtypes = [POINTER(TVersao)]
+    lib.kdtree_solta.restype = None
+
+    lib.buscar_n_mais_proximos_versao.argtypes = [POINTER(TVersao), TReg, c_int]
+    lib.buscar_n_mais_proximos_versao.restype = TRegArray
+
     lib.free_treg_array.argtypes = [TRegArray]
     lib.free_treg_array.restype = None
+
+    # Persistence: mmap-able snapshot plus append-only write log (0 = EXIT_SUCCESS)
+    lib.salvar_arvore.argtypes = [ctypes.c_char_p]
+    lib.salvar_arvore.restype = c_int
+
+    lib.carregar_arvore.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    lib.carregar_arvore.restype = c_int
+
+    # Return 0 (EXIT_SUCCESS) when the person_id exists
+    lib.remover_ponto.argtypes = [c_char * MAX_PERSON_ID_LEN]
+    lib.remover_ponto.restype = c_int
+
+    lib.atualizar_ponto.argtypes = [c_double, c_double, c_float * EMBEDDING_DIM, c_char * MAX_PERSON_ID_LEN]
+    lib.atualizar_ponto.restype = c_int
+
+    # Bulk API: contiguous buffers in, contiguous C-owned blocks out
+    lib.inserir_pontos_lote.argtypes = [c_int, c_void_p, c_void_p, c_void_p, c_int]
+    lib.inserir_pontos_lote.restype = None
+
+    lib.buscar_lote.argtypes = [POINTER(Tarv), c_int, c_void_p, c_int]
+    lib.buscar_lote.restype = POINTER(TResultadoLote)
+
+    lib.libera_resultado_lote.argtypes = [POINTER(TResultadoLote)]
+    lib.libera_resultado_lote.restype = None
+
+    lib.copia_campo_lote.argtypes = [POINTER(TResultadoLote), ctypes.c_size_t, ctypes.c_size_t, c_void_p]
+    lib.copia_campo_lote.restype = c_int
+
+
+def inserir_lote(coords, embeddings, ids):
+    """Insert N points in one C call.
+
+    coords: (N, 2) lat/lon, embeddings: (N, EMBEDDING_DIM), ids: N str or bytes
+    (or a NumPy 'S' array). Inputs that are already contiguous float64/float32/'S'
+    arrays are passed to C without copying.
+    """
+    coords = np.ascontiguousarray(coords, dtype=np.float64).reshape(-1, 2)
+    embeddings = np.ascontiguousarray(embeddings, dtype=np.float32).reshape(-1, EMBEDDING_DIM)
+    ids = np.asarray(ids)
+    if ids.dtype.kind == "U":
+        ids = np.char.encode(ids, "utf-8")
+    if ids.dtype.kind != "S":
+        ids = ids.astype(f"S{MAX_PERSON_ID_LEN - 1}")
+    ids = np.ascontiguousarray(ids)
+    n = len(coords)
+    if len(embeddings) != n or len(ids) != n:
+        raise ValueError("coords, embeddings and ids must have the same length")
+    lib.inserir_pontos_lote(n, coords.ctypes.data, embeddings.ctypes.data, ids.ctypes.data, ids.dtype.itemsize)
+
+
+class ResultadoLote:
+    """Result of buscar_lote.
+
+    tamanhos (N,), distancias (N, k) and ponteiros (N, k) are views into C-owned
+    memory, sorted by increasing distance. ponteiros holds the address of each
+    neighbour's record inside the tree (0 for empty slots): nothing is copied, the
+    searched version stays pinned instead, taking one of the tree's reader slots.
+    campo(name) copies a single TREG_DTYPE field of every neighbour into a new array,
+    regs copies whole records. Each view keeps this object alive, so the version is
+    released and the memory freed once the last view is gone, or explicitly by
+    liberar() (or the end of a with block), after which the views must not be used.
+    """
+
+    def __init__(self, ptr):
+        self._ptr = ptr
+        r = ptr.contents
+        n, k = r.n_consultas, r.k
+        self.tamanhos = self._visao(r.tamanhos, n * ctypes.sizeof(c_int), np.intc, (n,))
+        self.distancias = self._visao(r.distancias, n * k * ctypes.sizeof(c_double), np.float64, (n, k))
+        self.ponteiros = self._visao(r.regs, n * k * ctypes.sizeof(c_void_p), np.uintp, (n, k))
+
+    def _visao(self, ponteiro, tamanho, dtype, forma):
+        buffer = (c_char * tamanho).from_address(ctypes.cast(ponteiro, c_void_p).value)
+        buffer._dono = self  # The array's base is this buffer, so views and their slices keep the result alive
+        return np.frombuffer(buffer, dtype=dtype).reshape(forma)
+
+    def _copia(self, deslocamento, dtype):
+        if not self._ptr:
+            raise ValueError("result already released")
+        r = self._ptr.contents
+        destino = np.zeros((r.n_consultas, r.k), dtype=dtype)  # Subarray fields add their own axes
+        if lib.copia_campo_lote(self._ptr, deslocamento, dtype.itemsize, destino.ctypes.data) != 0:
+            raise ValueError("field outside TReg")
+        return destino
+
+    def campo(self, nome):
+        """Copy one TReg field of every neighbour into an (N, k) array; empty slots are zero."""
+        dtype, deslocamento = TREG_DTYPE.fields[nome][:2]
+        return self._copia(deslocamento, dtype)
+
+    @property
+    def regs(self):
+        """Copy of the whole records as an (N, k) TREG_DTYPE array."""
+        return self._copia(0, TREG_DTYPE)
+
+    def liberar(self):
+        if self._ptr:
+            lib.libera_resultado_lote(self._ptr)
+            self._ptr = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.liberar()
+
+    def __del__(self):
+        self.liberar()
+
+
+def buscar_lote(coords, k, arv=None):
+    """Search the k nearest neighbours of each (lat, lon) row of coords in one C call."""
+    coords = np.ascontiguousarray(coords, dtype=np.float64).reshape(-1, 2)
+    ptr = lib.buscar_lote(arv if arv is not None else lib.get_tree(), len(coords), coords.ctypes.data, k)
+    if not ptr:
+        raise MemoryError("buscar_lote failed")
+    return ResultadoLote(ptr)
+
+
+def metricas(arv=None):
+    """Current search metrics of a tree (the global one by default)."""
+    m = TMetricas()
+    lib.kdtree_metricas(arv if arv is not None else lib.get_tree(), ctypes.byref(m))
+    return m
+
+
+# Self-test of the NumPy bridge: python kdtree_wrapper.py (needs ./libkdtree.so)
+if __name__ == "__main__":
+    import gc
+
+    assert lib is not None, "libkdtree.so not loaded"
+    arv = lib.kdtree_cria()
+    embedding = np.zeros(EMBEDDING_DIM, dtype=np.float32)
+    for i in range(100):
+        lib.kdtree_insere_ponto(arv, float(i), float(i), embedding.ctypes.data, f"p{i}".encode())
+
+    # Views outlive the result object they came from
+    distancias = buscar_lote([[10.0, 10.0], [50.0, 50.0]], 3, arv).distancias
+    ponteiros = buscar_lote([[10.0, 10.0]], 1, arv).ponteiros
+    gc.collect()
+    buscar_lote(np.zeros((50, 2)), 3, arv).liberar()  # Would reuse the memory if the views were dangling
+    assert distancias.tolist() == [[0.0, 2.0, 2.0], [0.0, 2.0, 2.0]], distancias
+    reg = TReg.from_address(int(ponteiros[0, 0]))  # The pinned version keeps the record alive
+    assert (reg.lat, reg.person_id) == (10.0, b"p10"), (reg.lat, reg.person_id)
+    del distancias, ponteiros, reg
+
+    with buscar_lote([[0.0, 0.0]] * 5, 2, arv) as res:
+        assert res.tamanhos.tolist() == [2] * 5
+        assert res.campo("person_id")[0].tolist() == [b"p0", b"p1"]
+        assert res.regs[0]["lon"].tolist() == [0.0, 1.0]
+    embedding[:] = 1.5
+    lib.kdtree_insere_ponto(arv, 200.0, 200.0, embedding.ctypes.data, b"p200")
+    with buscar_lote([[200.0, 200.0]], 2, arv) as res:
+        embeddings = res.campo("embedding")
+        assert embeddings.shape == (1, 2, EMBEDDING_DIM)
+        assert (embeddings[0, 0] == 1.5).all() and (embeddings[0, 1] == 0.0).all()
+    with buscar_lote([[0.0, 0.0]], 102, arv) as res:
+        assert res.ponteiros[0, 101] == 0 and res.campo("lat")[0, 101] == 0.0
+    lib.kdtree_libera(arv)
+    print("kdtree_wrapper self-test passed")